@@ -1,26 +1,91 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2022 Julien Bernard
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
 
 #include <cairo.h>
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
+#include <png.h>
 
 #include "agate.h"
 #include "agate-support.h"
 
 #include "config.h"
 
+#ifdef AGRAPHICS_HAS_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef AGRAPHICS_HAS_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 #define AG_VECTOR2_TAG  0x1000
 #define AG_MATRIX_TAG   0x1001
 #define AG_COLOR_TAG    0x1002
 #define AG_SURFACE_TAG  0x1003
 #define AG_PATTERN_TAG  0x1004
 #define AG_CONTEXT_TAG  0x1004
+#define AG_FONT_TAG     0x1005
+#define AG_EXTENTS_TAG  0x1006
+#define AG_BUFFER_TAG   0x1007
+#define AG_ATLAS_TAG    0x1008
+#define AG_PREVIEW_TAG  0x1009
+#define AG_PATH_TAG     0x100A
+#define AG_STROKED_TAG  0x100B
+#define AG_HEATMAP_TAG  0x100C
+
+#define AG_SPATIAL_INDEX_CELL_SIZE 64.0
+#define AG_SPATIAL_INDEX_MAX_CELLS 4096
+
+#define AG_GLYPH_CACHE_FONTS 16
+#define AG_GLYPH_CACHE_CHARS 128
+
+#define AG_IMAGE_CACHE_BUDGET (64 * 1024 * 1024)
+#define AG_IMAGE_MAX_SIZE 32767 // cairo refuses larger image surfaces
+#define AG_RESAMPLE_RING_MEMORY (32 * 1024 * 1024)
+#define AG_RESAMPLE_GRAIN_PIXELS 65536
+
+#define AG_SPRITE_PADDING 1
+#define AG_SPRITE_INSTANCE_SIZE 6
+
+#define AG_PI 3.14159265358979323846
+
+#define AG_PATH_MAX_SUBDIVISIONS 16
+#define AG_STROKE_TOLERANCE 0.05
+#define AG_STROKE_MITER_LIMIT 10.0
+#define AG_SOLID_CACHE_SIZE 32
+#define AG_PLOT_CHUNK 65536
+#define AG_PLOT_MAX_COLUMN 1e15
+#define AG_HEATMAP_BAND 16
+#define AG_HEATMAP_RAMP_SIZE 256
+#define AG_TILE_SIZE 256
+#define AG_TILE_MAX_ZOOM 22
+#define AG_TILE_BATCH 64
+#define AG_COMPOSITE_GRAIN_PIXELS 65536
+#define AG_CIRCLE_KAPPA 0.5522847498307936
+
+#define AG_HASH_SEED UINT64_C(14695981039346656037)
+#define AG_HASH_PRIME UINT64_C(1099511628211)
+
+#define AG_MAX_THREADS 64
+#define AG_PARALLEL_GRAIN 64
 
 /*
  * Tools
@@ -46,6 +111,125 @@ static inline double max3(double x, double y, double z) {
   return max2(x, max2(y, z));
 }
 
+// NaN gives 0
+static inline double clamp01(double x) {
+  return !(x > 0.0) ? 0.0 : min2(x, 1.0);
+}
+
+static inline int min2i(int x, int y) {
+  return x < y ? x : y;
+}
+
+static inline int max2i(int x, int y) {
+  return x > y ? x : y;
+}
+
+typedef void (*AgParallelFunc)(void *data, size_t begin, size_t end);
+
+#ifdef AGRAPHICS_HAS_PTHREADS
+struct ParallelTask {
+  AgParallelFunc func;
+  void *data;
+  size_t begin;
+  size_t end;
+};
+
+static void *agParallelRun(void *raw) {
+  struct ParallelTask *task = raw;
+  task->func(task->data, task->begin, task->end);
+  return NULL;
+}
+
+static size_t agThreadCount(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (count < 1) {
+    return 1;
+  }
+
+  return count > AG_MAX_THREADS ? AG_MAX_THREADS : (size_t) count;
+}
+#endif
+
+// calls func on disjoint ranges of [0, count), with at least grain items per range
+static void agParallelFor(size_t count, size_t grain, AgParallelFunc func, void *data) {
+#ifdef AGRAPHICS_HAS_PTHREADS
+  size_t thread_count = agThreadCount();
+
+  if (grain == 0) {
+    grain = 1;
+  }
+
+  if (thread_count > count / grain) {
+    thread_count = count / grain;
+  }
+
+  if (thread_count > 1) {
+    pthread_t threads[AG_MAX_THREADS];
+    struct ParallelTask tasks[AG_MAX_THREADS];
+    size_t started = 0;
+
+    for (size_t i = 0; i < thread_count; ++i) {
+      tasks[i].func = func;
+      tasks[i].data = data;
+      tasks[i].begin = count * i / thread_count;
+      tasks[i].end = count * (i + 1) / thread_count;
+    }
+
+    for (size_t i = 1; i < thread_count; ++i) {
+      if (pthread_create(&threads[i], NULL, agParallelRun, &tasks[i]) != 0) {
+        break;
+      }
+
+      ++started;
+    }
+
+    // the calling thread takes the first range, and the ranges of threads that could not start
+    agParallelRun(&tasks[0]);
+
+    for (size_t i = started + 1; i < thread_count; ++i) {
+      agParallelRun(&tasks[i]);
+    }
+
+    for (size_t i = 1; i <= started; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+
+    return;
+  }
+#endif
+
+  func(data, 0, count);
+}
+
+// FNV-1a
+static inline uint64_t agHash(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= AG_HASH_PRIME;
+  }
+
+  return hash;
+}
+
+static inline uint64_t agHashDouble(uint64_t hash, double value) {
+  return agHash(hash, &value, sizeof(value));
+}
+
+static inline uint64_t agHashInt(uint64_t hash, int64_t value) {
+  return agHash(hash, &value, sizeof(value));
+}
+
+static inline double agSlotGetNumber(AgateVM *vm, ptrdiff_t slot) {
+  if (agateSlotType(vm, slot) == AGATE_TYPE_INT) {
+    return (double) agateSlotGetInt(vm, slot);
+  }
+
+  return agateSlotGetFloat(vm, slot);
+}
+
 /*
  * Vector2
  */
@@ -101,706 +285,5669 @@ static void agVector2YSetter(AgateVM *vm) {
 }
 
 /*
- * Matrix
+ * FloatBuffer
  */
 
-// class
+struct FloatBuffer {
+  double *data;
+  size_t size;
+  size_t capacity;
+};
 
-static ptrdiff_t agMatrixAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return sizeof(cairo_matrix_t);
-}
+static void agFloatBufferReserve(struct FloatBuffer *buffer, size_t capacity) {
+  if (capacity <= buffer->capacity) {
+    return;
+  }
 
-static uint64_t agMatrixTag(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return AG_MATRIX_TAG;
+  if (capacity < 2 * buffer->capacity) {
+    capacity = 2 * buffer->capacity;
+  }
+
+  buffer->data = realloc(buffer->data, capacity * sizeof(double));
+  assert(buffer->data);
+  buffer->capacity = capacity;
 }
 
-// methods
+// a read-only view of numbers given either as a FloatBuffer or as an Array
+struct FloatView {
+  const double *data;
+  size_t size;
+  double *owned;
+};
 
-static void agMatrixNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  cairo_matrix_init_identity(matrix);
+static void agSlotGetFloatView(AgateVM *vm, ptrdiff_t slot, struct FloatView *view) {
+  if (agateSlotType(vm, slot) == AGATE_TYPE_FOREIGN && agateSlotGetForeignTag(vm, slot) == AG_BUFFER_TAG) {
+    struct FloatBuffer *buffer = agateSlotGetForeign(vm, slot);
+    view->data = buffer->data;
+    view->size = buffer->size;
+    view->owned = NULL;
+    return;
+  }
+
+  ptrdiff_t size = agateSlotArraySize(vm, slot);
+  ptrdiff_t element_slot = agateSlotAllocate(vm);
+  view->owned = malloc((size_t) (size + 1) * sizeof(double));
+  assert(view->owned);
+
+  for (ptrdiff_t i = 0; i < size; ++i) {
+    agateSlotArrayGet(vm, slot, i, element_slot);
+    view->owned[i] = agSlotGetNumber(vm, element_slot);
+  }
+
+  view->data = view->owned;
+  view->size = (size_t) size;
 }
 
-static void agMatrixNewTranslate(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  double tx = agateSlotGetFloat(vm, 1);
-  double ty = agateSlotGetFloat(vm, 2);
-  cairo_matrix_init_translate(matrix, tx, ty);
+static void agFloatViewRelease(struct FloatView *view) {
+  free(view->owned);
+  view->owned = NULL;
 }
 
-static void agMatrixNewScale(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  double sx = agateSlotGetFloat(vm, 1);
-  double sy = agateSlotGetFloat(vm, 2);
-  cairo_matrix_init_scale(matrix, sx, sy);
+// two views of the same size in consecutive slots, aborts otherwise
+static bool agSlotGetFloatColumns(AgateVM *vm, ptrdiff_t slot, struct FloatView *first, struct FloatView *second) {
+  agSlotGetFloatView(vm, slot, first);
+  agSlotGetFloatView(vm, slot + 1, second);
+
+  if (first->size != second->size) {
+    agFloatViewRelease(first);
+    agFloatViewRelease(second);
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Columns of different sizes");
+    agateAbort(vm, string_slot);
+    return false;
+  }
+
+  return true;
 }
 
-static void agMatrixNewRotate(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  double angle = agateSlotGetFloat(vm, 1);
-  cairo_matrix_init_rotate(matrix, angle);
+// class
+
+static ptrdiff_t agFloatBufferAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct FloatBuffer);
 }
 
-static void agMatrixTranslate(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  double tx = agateSlotGetFloat(vm, 1);
-  double ty = agateSlotGetFloat(vm, 2);
-  cairo_matrix_translate(matrix, tx, ty);
+static uint64_t agFloatBufferTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_BUFFER_TAG;
 }
 
-static void agMatrixScale(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  double sx = agateSlotGetFloat(vm, 1);
-  double sy = agateSlotGetFloat(vm, 2);
-  cairo_matrix_scale(matrix, sx, sy);
+void agFloatBufferDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct FloatBuffer *buffer = data;
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->size = buffer->capacity = 0;
 }
 
-static void agMatrixRotate(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  double angle = agateSlotGetFloat(vm, 1);
-  cairo_matrix_rotate(matrix, angle);
+// methods
+
+static void agFloatBufferNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  buffer->data = NULL;
+  buffer->size = buffer->capacity = 0;
 }
 
-static void agMatrixInvert(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+static void agFloatBufferNewSized(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  int64_t size = agateSlotGetInt(vm, 1);
+  buffer->data = NULL;
+  buffer->size = buffer->capacity = 0;
+
+  if (size > 0) {
+    agFloatBufferReserve(buffer, (size_t) size);
+    memset(buffer->data, 0, (size_t) size * sizeof(double));
+    buffer->size = (size_t) size;
+  }
+}
 
-  if (cairo_matrix_invert(matrix) != CAIRO_STATUS_SUCCESS) {
+static void agFloatBufferSizeGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, (int64_t) buffer->size);
+}
+
+static bool agFloatBufferCheckIndex(AgateVM *vm, struct FloatBuffer *buffer, int64_t index) {
+  if (index < 0 || (size_t) index >= buffer->size) {
     ptrdiff_t string_slot = agateSlotAllocate(vm);
-    agateSlotSetString(vm, string_slot, "Unable to invert the matrix");
+    agateSlotSetString(vm, string_slot, "Index out of bounds");
     agateAbort(vm, string_slot);
+    return false;
   }
+
+  return true;
 }
 
-static void agMatrixMultiply(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_MATRIX_TAG);
-  cairo_matrix_t *other = agateSlotGetForeign(vm, 1);
+static void agFloatBufferSubscriptGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  int64_t index = agateSlotGetInt(vm, 1);
 
-  ptrdiff_t class_slot = agateSlotAllocate(vm);
-  agateGetVariable(vm, "agraphics", "Matrix", class_slot);
+  if (agFloatBufferCheckIndex(vm, buffer, index)) {
+    agateSlotSetFloat(vm, AGATE_RETURN_SLOT, buffer->data[index]);
+  }
+}
 
-  ptrdiff_t result_slot = agateSlotAllocate(vm);
-  cairo_matrix_t *result = agateSlotSetForeign(vm, result_slot, class_slot);
-  cairo_matrix_multiply(result, matrix, other);
+static void agFloatBufferSubscriptSetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  int64_t index = agateSlotGetInt(vm, 1);
 
-  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+  if (agFloatBufferCheckIndex(vm, buffer, index)) {
+    buffer->data[index] = agSlotGetNumber(vm, 2);
+    agateSlotSetFloat(vm, AGATE_RETURN_SLOT, buffer->data[index]);
+  }
+}
+
+static void agFloatBufferPush(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  agFloatBufferReserve(buffer, buffer->size + 1);
+  buffer->data[buffer->size++] = agSlotGetNumber(vm, 1);
+}
+
+static void agFloatBufferClear(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_BUFFER_TAG);
+  struct FloatBuffer *buffer = agateSlotGetForeign(vm, 0);
+  buffer->size = 0;
 }
 
 /*
- * Color
+ * Path
  */
 
-struct Color {
-  double r;
-  double g;
-  double b;
-  double a;
+// same values as in the Path class
+enum PathCommand {
+  AG_PATH_MOVE_TO = 1,
+  AG_PATH_LINE_TO = 2,
+  AG_PATH_CURVE_TO = 3,
+  AG_PATH_CLOSE = 4,
 };
 
-// class
+struct Path {
+  unsigned char *commands;
+  size_t command_count;
+  size_t command_capacity;
+  struct Vector2 *points;
+  size_t point_count;
+  size_t point_capacity;
+  size_t subpath_start; // index of the point of the last move_to, the current point after a close
+  cairo_path_t *cache; // built when the path is drawn, dropped when it is modified
+};
 
-static ptrdiff_t agColorAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return sizeof(struct Color);
+static void agPathInit(struct Path *path) {
+  path->commands = NULL;
+  path->command_count = path->command_capacity = 0;
+  path->points = NULL;
+  path->point_count = path->point_capacity = 0;
+  path->subpath_start = 0;
+  path->cache = NULL;
 }
 
-static uint64_t agColorTag(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return AG_COLOR_TAG;
+static void agPathInvalidate(struct Path *path) {
+  if (path->cache != NULL) {
+    free(path->cache->data);
+    free(path->cache);
+    path->cache = NULL;
+  }
 }
 
-// methods
-
-static void agColorNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  color->r = agateSlotGetFloat(vm, 1);
-  color->g = agateSlotGetFloat(vm, 2);
-  color->b = agateSlotGetFloat(vm, 3);
-  color->a = agateSlotGetFloat(vm, 4);
+static void agPathRelease(struct Path *path) {
+  agPathInvalidate(path);
+  free(path->commands);
+  free(path->points);
+  agPathInit(path);
 }
 
-static void agColorRGetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->r);
-}
+static void agPathAppend(struct Path *path, enum PathCommand command, const struct Vector2 *points, size_t count) {
+  agPathInvalidate(path);
 
-static void agColorRSetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  color->r = agateSlotGetFloat(vm, 1);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->r);
-}
+  if (path->command_count == path->command_capacity) {
+    path->command_capacity = path->command_capacity == 0 ? 64 : 2 * path->command_capacity;
+    path->commands = realloc(path->commands, path->command_capacity * sizeof(unsigned char));
+    assert(path->commands);
+  }
 
-static void agColorGGetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->g);
-}
+  path->commands[path->command_count++] = (unsigned char) command;
 
-static void agColorGSetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  color->g = agateSlotGetFloat(vm, 1);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->g);
-}
+  if (command == AG_PATH_MOVE_TO) {
+    path->subpath_start = path->point_count;
+  }
 
-static void agColorBGetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->b);
-}
+  if (path->point_count + count > path->point_capacity) {
+    while (path->point_count + count > path->point_capacity) {
+      path->point_capacity = path->point_capacity == 0 ? 64 : 2 * path->point_capacity;
+    }
 
-static void agColorBSetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  color->b = agateSlotGetFloat(vm, 1);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->b);
+    path->points = realloc(path->points, path->point_capacity * sizeof(struct Vector2));
+    assert(path->points);
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    path->points[path->point_count++] = points[i];
+  }
 }
 
-static void agColorAGetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->a);
+static void agPathCopy(struct Path *output, const struct Path *input) {
+  for (size_t i = 0, point = 0; i < input->command_count; ++i) {
+    size_t count = input->commands[i] == AG_PATH_CURVE_TO ? 3 : (input->commands[i] == AG_PATH_CLOSE ? 0 : 1);
+    agPathAppend(output, (enum PathCommand) input->commands[i], input->points + point, count);
+    point += count;
+  }
 }
 
-static void agColorASetter(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  color->a = agateSlotGetFloat(vm, 1);
-  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->a);
+static void agPathAppendPoint(struct Path *path, enum PathCommand command, double x, double y) {
+  struct Vector2 point = { x, y };
+  agPathAppend(path, command, &point, 1);
 }
 
-struct HSV {
-  double h;
-  double s;
-  double v;
-  double a;
-};
+static const cairo_path_t *agPathToCairo(struct Path *path) {
+  if (path->cache != NULL) {
+    return path->cache;
+  }
 
-static void agConvertRgbToHsv(struct HSV *hsv, const struct Color *color) {
-  const double r = color->r;
-  const double g = color->g;
-  const double b = color->b;
+  size_t count = 0;
+
+  for (size_t i = 0; i < path->command_count; ++i) {
+    switch (path->commands[i]) {
+      case AG_PATH_MOVE_TO:
+      case AG_PATH_LINE_TO:
+        count += 2;
+        break;
+      case AG_PATH_CURVE_TO:
+        count += 4;
+        break;
+      default:
+        count += 1;
+        break;
+    }
+  }
 
-  const double min = min3(color->r, color->g, color->b);
-  const double max = max3(color->r, color->g, color->b);
+  cairo_path_t *cache = malloc(sizeof(cairo_path_t));
+  assert(cache);
+  cache->status = CAIRO_STATUS_SUCCESS;
+  cache->data = malloc((count + 1) * sizeof(cairo_path_data_t));
+  cache->num_data = (int) count;
+  assert(cache->data);
+
+  cairo_path_data_t *data = cache->data;
+  const struct Vector2 *point = path->points;
+
+  for (size_t i = 0; i < path->command_count; ++i) {
+    int length = 0;
+
+    switch (path->commands[i]) {
+      case AG_PATH_MOVE_TO:
+        data->header.type = CAIRO_PATH_MOVE_TO;
+        length = 1;
+        break;
+      case AG_PATH_LINE_TO:
+        data->header.type = CAIRO_PATH_LINE_TO;
+        length = 1;
+        break;
+      case AG_PATH_CURVE_TO:
+        data->header.type = CAIRO_PATH_CURVE_TO;
+        length = 3;
+        break;
+      default:
+        data->header.type = CAIRO_PATH_CLOSE_PATH;
+        break;
+    }
 
-  if ((max - min) > DBL_EPSILON) {
-    if (max == r) {
-      hsv->h = fmod(60 * (g - b) / (max - min) + 360, 360);
-    } else if (max == g) {
-      hsv->h = 60 * (b - r) / (max - min) + 120;
-    } else if (max == b) {
-      hsv->h = 60 * (r - g) / (max - min) + 240;
-    } else {
-      assert(false);
+    data->header.length = length + 1;
+
+    for (int j = 1; j <= length; ++j) {
+      data[j].point.x = point->x;
+      data[j].point.y = point->y;
+      ++point;
     }
-  } else {
-    hsv->h = 0;
+
+    data += length + 1;
   }
 
-  hsv->s = (max < DBL_EPSILON ? 0 : (1 - min / max));
-  hsv->v = max;
-  hsv->a = color->a;
+  path->cache = cache;
+  return cache;
 }
 
-static void agConvertHsvToRgb(struct Color *color, const struct HSV *hsv) {
-  const double h = hsv->h / 60;
-  const double s = hsv->s;
-  const double v = hsv->v;
-
-  const int i = ((int) h) % 6;
-  assert(0 <= i && i < 6);
+static void agPathFromCairo(struct Path *path, const cairo_path_t *cairo_path) {
+  for (int i = 0; i < cairo_path->num_data; i += cairo_path->data[i].header.length) {
+    const cairo_path_data_t *data = &cairo_path->data[i];
+
+    switch (data->header.type) {
+      case CAIRO_PATH_MOVE_TO:
+        agPathAppendPoint(path, AG_PATH_MOVE_TO, data[1].point.x, data[1].point.y);
+        break;
+      case CAIRO_PATH_LINE_TO:
+        agPathAppendPoint(path, AG_PATH_LINE_TO, data[1].point.x, data[1].point.y);
+        break;
+      case CAIRO_PATH_CURVE_TO: {
+        struct Vector2 points[3] = {
+          { data[1].point.x, data[1].point.y },
+          { data[2].point.x, data[2].point.y },
+          { data[3].point.x, data[3].point.y },
+        };
+        agPathAppend(path, AG_PATH_CURVE_TO, points, 3);
+        break;
+      }
+      case CAIRO_PATH_CLOSE_PATH:
+        agPathAppend(path, AG_PATH_CLOSE, NULL, 0);
+        break;
+    }
+  }
+}
 
-  const double f = h - (double) i;
-  const double x = v * (1 - s);
-  const double y = v * (1 - (f * s));
-  const double z = v * (1 - (1 - f) * s);
+static double agDistanceToSegment(const struct Vector2 *p, const struct Vector2 *a, const struct Vector2 *b) {
+  double dx = b->x - a->x;
+  double dy = b->y - a->y;
+  double length2 = dx * dx + dy * dy;
 
-  switch (i) {
-    case 0: color->r = v; color->g = z; color->b = x; break;
-    case 1: color->r = y; color->g = v; color->b = x; break;
-    case 2: color->r = x; color->g = v; color->b = z; break;
-    case 3: color->r = x; color->g = y; color->b = v; break;
-    case 4: color->r = z; color->g = x; color->b = v; break;
-    case 5: color->r = v; color->g = x; color->b = y; break;
-    default: assert(false); break;
+  if (length2 < DBL_EPSILON) {
+    return hypot(p->x - a->x, p->y - a->y);
   }
 
-  color->a = hsv->a;
+  // a control point beyond an end of the chord is as far as that end, not as the infinite line
+  double t = ((p->x - a->x) * dx + (p->y - a->y) * dy) / length2;
+  t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+  return hypot(p->x - (a->x + t * dx), p->y - (a->y + t * dy));
 }
 
-static void agColorDarker(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  double percent = agateSlotGetFloat(vm, 1);
+// subdivides the curve until its control points are within the tolerance of its chord
+static void agPathFlattenCurve(struct Path *output, struct Vector2 p0, struct Vector2 p1, struct Vector2 p2, struct Vector2 p3, double tolerance, int depth) {
+  if (depth >= AG_PATH_MAX_SUBDIVISIONS || (agDistanceToSegment(&p1, &p0, &p3) <= tolerance && agDistanceToSegment(&p2, &p0, &p3) <= tolerance)) {
+    agPathAppend(output, AG_PATH_LINE_TO, &p3, 1);
+    return;
+  }
 
-  struct HSV hsv;
-  agConvertRgbToHsv(&hsv, color);
-  hsv.v -= hsv.v * percent;
-  agConvertHsvToRgb(color, &hsv);
+  struct Vector2 p01 = { 0.5 * (p0.x + p1.x), 0.5 * (p0.y + p1.y) };
+  struct Vector2 p12 = { 0.5 * (p1.x + p2.x), 0.5 * (p1.y + p2.y) };
+  struct Vector2 p23 = { 0.5 * (p2.x + p3.x), 0.5 * (p2.y + p3.y) };
+  struct Vector2 p012 = { 0.5 * (p01.x + p12.x), 0.5 * (p01.y + p12.y) };
+  struct Vector2 p123 = { 0.5 * (p12.x + p23.x), 0.5 * (p12.y + p23.y) };
+  struct Vector2 mid = { 0.5 * (p012.x + p123.x), 0.5 * (p012.y + p123.y) };
+
+  agPathFlattenCurve(output, p0, p01, p012, mid, tolerance, depth + 1);
+  agPathFlattenCurve(output, mid, p123, p23, p3, tolerance, depth + 1);
 }
 
-static void agColorLighter(AgateVM* vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 0);
-  double percent = agateSlotGetFloat(vm, 1);
+static void agPathBuildFlat(struct Path *output, const struct Path *input, double tolerance) {
+  const struct Vector2 *point = input->points;
+  struct Vector2 current = { 0.0, 0.0 };
+  struct Vector2 start = { 0.0, 0.0 };
+
+  for (size_t i = 0; i < input->command_count; ++i) {
+    switch (input->commands[i]) {
+      case AG_PATH_MOVE_TO:
+        current = start = *point++;
+        agPathAppend(output, AG_PATH_MOVE_TO, &current, 1);
+        break;
+      case AG_PATH_LINE_TO:
+        current = *point++;
+        agPathAppend(output, AG_PATH_LINE_TO, &current, 1);
+        break;
+      case AG_PATH_CURVE_TO:
+        agPathFlattenCurve(output, current, point[0], point[1], point[2], tolerance, 0);
+        current = point[2];
+        point += 3;
+        break;
+      default:
+        agPathAppend(output, AG_PATH_CLOSE, NULL, 0);
+        current = start;
+        break;
+    }
+  }
+}
 
-  struct HSV hsv;
-  agConvertRgbToHsv(&hsv, color);
-  hsv.v += hsv.v * percent;
+// Douglas-Peucker on points[first..last], keeps the endpoints
+static void agPathSimplifyPolyline(const struct Vector2 *points, bool *keep, size_t first, size_t last, double tolerance) {
+  size_t stack_capacity = 64;
+  size_t stack_size = 0;
+  size_t *stack = malloc(2 * stack_capacity * sizeof(size_t));
+  assert(stack);
+
+  keep[first] = keep[last] = true;
+  stack[stack_size * 2] = first;
+  stack[stack_size * 2 + 1] = last;
+  ++stack_size;
+
+  while (stack_size > 0) {
+    --stack_size;
+    size_t a = stack[stack_size * 2];
+    size_t b = stack[stack_size * 2 + 1];
+
+    double farthest_distance = 0.0;
+    size_t farthest = a;
+
+    for (size_t i = a + 1; i < b; ++i) {
+      double distance = agDistanceToSegment(&points[i], &points[a], &points[b]);
+
+      if (distance > farthest_distance) {
+        farthest_distance = distance;
+        farthest = i;
+      }
+    }
 
-  if (hsv.v > 1) {
-    hsv.s -= (hsv.v - 1);
+    if (farthest_distance <= tolerance) {
+      continue;
+    }
 
-    if (hsv.s < 0) {
-      hsv.s = 0;
+    keep[farthest] = true;
+
+    if (stack_size + 2 > stack_capacity) {
+      stack_capacity *= 2;
+      stack = realloc(stack, 2 * stack_capacity * sizeof(size_t));
+      assert(stack);
     }
 
-    hsv.v = 1;
+    stack[stack_size * 2] = a;
+    stack[stack_size * 2 + 1] = farthest;
+    ++stack_size;
+    stack[stack_size * 2] = farthest;
+    stack[stack_size * 2 + 1] = b;
+    ++stack_size;
   }
 
-  agConvertHsvToRgb(color, &hsv);
+  free(stack);
+}
+
+static void agPathBuildSimplified(struct Path *output, const struct Path *input, double tolerance) {
+  // curves are flattened first, with a fraction of the tolerance
+  struct Path flat;
+  agPathInit(&flat);
+  agPathBuildFlat(&flat, input, 0.25 * tolerance);
+
+  bool *keep = calloc(flat.point_count + 1, sizeof(bool));
+  assert(keep);
+
+  // each subpath starts with a move_to and is made of line_to
+  size_t command = 0;
+  size_t point = 0;
+
+  while (command < flat.command_count) {
+    if (flat.commands[command] == AG_PATH_CLOSE) {
+      ++command;
+      continue;
+    }
+
+    size_t first = point;
+
+    do {
+      ++command;
+      ++point;
+    } while (command < flat.command_count && flat.commands[command] == AG_PATH_LINE_TO);
+
+    agPathSimplifyPolyline(flat.points, keep, first, point - 1, tolerance);
+  }
+
+  point = 0;
+
+  for (size_t i = 0; i < flat.command_count; ++i) {
+    if (flat.commands[i] == AG_PATH_CLOSE) {
+      agPathAppend(output, AG_PATH_CLOSE, NULL, 0);
+      continue;
+    }
+
+    if (keep[point]) {
+      agPathAppend(output, (enum PathCommand) flat.commands[i], &flat.points[point], 1);
+    }
+
+    ++point;
+  }
+
+  free(keep);
+  agPathRelease(&flat);
+}
+
+// class
+
+static ptrdiff_t agPathAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Path);
+}
+
+static uint64_t agPathTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_PATH_TAG;
+}
+
+void agPathDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Path *path = data;
+  agPathRelease(path);
+}
+
+// methods
+
+static struct Path *agSlotSetNewPath(AgateVM *vm, ptrdiff_t slot) {
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Path", class_slot);
+
+  struct Path *path = agateSlotSetForeign(vm, slot, class_slot);
+  agPathInit(path);
+  return path;
+}
+
+// like cairo, the current point after a close is the start of the closed subpath
+static bool agPathCurrentPoint(AgateVM *vm, const struct Path *path, struct Vector2 *current) {
+  if (path->point_count == 0) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "No current point in the path");
+    agateAbort(vm, string_slot);
+    return false;
+  }
+
+  if (path->commands[path->command_count - 1] == AG_PATH_CLOSE) {
+    *current = path->points[path->subpath_start];
+  } else {
+    *current = path->points[path->point_count - 1];
+  }
+
+  return true;
+}
+
+static void agPathNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  agPathInit(path);
+}
+
+static void agPathMoveTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *p = agateSlotGetForeign(vm, 1);
+  agPathAppend(path, AG_PATH_MOVE_TO, p, 1);
+}
+
+static void agPathLineTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *p = agateSlotGetForeign(vm, 1);
+  agPathAppend(path, AG_PATH_LINE_TO, p, 1);
+}
+
+static void agPathCurveTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  struct Vector2 points[3];
+
+  for (int i = 0; i < 3; ++i) {
+    assert(agateSlotGetForeignTag(vm, i + 1) == AG_VECTOR2_TAG);
+    points[i] = *(struct Vector2 *) agateSlotGetForeign(vm, i + 1);
+  }
+
+  agPathAppend(path, AG_PATH_CURVE_TO, points, 3);
+}
+
+static void agPathRelMoveTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *p = agateSlotGetForeign(vm, 1);
+  struct Vector2 current;
+
+  if (agPathCurrentPoint(vm, path, &current)) {
+    agPathAppendPoint(path, AG_PATH_MOVE_TO, current.x + p->x, current.y + p->y);
+  }
+}
+
+static void agPathRelLineTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *p = agateSlotGetForeign(vm, 1);
+  struct Vector2 current;
+
+  if (agPathCurrentPoint(vm, path, &current)) {
+    agPathAppendPoint(path, AG_PATH_LINE_TO, current.x + p->x, current.y + p->y);
+  }
+}
+
+static void agPathRelCurveTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  struct Vector2 current;
+
+  if (!agPathCurrentPoint(vm, path, &current)) {
+    return;
+  }
+
+  struct Vector2 points[3];
+
+  for (int i = 0; i < 3; ++i) {
+    assert(agateSlotGetForeignTag(vm, i + 1) == AG_VECTOR2_TAG);
+    struct Vector2 *p = agateSlotGetForeign(vm, i + 1);
+    points[i].x = current.x + p->x;
+    points[i].y = current.y + p->y;
+  }
+
+  agPathAppend(path, AG_PATH_CURVE_TO, points, 3);
+}
+
+static void agPathClose(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  agPathAppend(path, AG_PATH_CLOSE, NULL, 0);
+}
+
+static void agPathCommandCountGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, (int64_t) path->command_count);
+}
+
+static void agPathCommand(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  int64_t index = agateSlotGetInt(vm, 1);
+
+  if (index < 0 || (size_t) index >= path->command_count) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Index out of bounds");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, path->commands[index]);
+}
+
+static void agPathPoint(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  int64_t index = agateSlotGetInt(vm, 1);
+
+  if (index < 0 || (size_t) index >= path->point_count) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Index out of bounds");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Vector2", class_slot);
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Vector2 *point = agateSlotSetForeign(vm, result_slot, class_slot);
+  *point = path->points[index];
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+static bool agPathCheckTolerance(AgateVM *vm, double tolerance) {
+  if (tolerance > 0.0 && isfinite(tolerance)) {
+    return true;
+  }
+
+  ptrdiff_t string_slot = agateSlotAllocate(vm);
+  agateSlotSetString(vm, string_slot, "The tolerance must be a positive number");
+  agateAbort(vm, string_slot);
+  return false;
+}
+
+static void agPathFlatten(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  double tolerance = agateSlotGetFloat(vm, 1);
+
+  if (!agPathCheckTolerance(vm, tolerance)) {
+    return;
+  }
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Path *result = agSlotSetNewPath(vm, result_slot);
+  agPathBuildFlat(result, path, tolerance);
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+static void agPathSimplify(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 0);
+  double tolerance = agateSlotGetFloat(vm, 1);
+
+  if (!agPathCheckTolerance(vm, tolerance)) {
+    return;
+  }
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Path *result = agSlotSetNewPath(vm, result_slot);
+  agPathBuildSimplified(result, path, tolerance);
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
 }
 
 /*
- * Surface
+ * StrokedPath
  */
 
-struct Surface {
-  cairo_surface_t *ptr;
+// the outline is a union of polygons with the same orientation, to be filled with the winding rule
+
+struct StrokeStyle {
+  double half_width;
+  cairo_line_cap_t cap;
+  cairo_line_join_t join;
+  double miter_limit;
+};
+
+// the curves of the path are flattened in the user space, the outline is built again when a finer tolerance is needed
+struct StrokedPath {
+  struct Path path;
+  struct StrokeStyle style;
+  struct Path outline;
+  double tolerance; // of the outline, 0 when it is not built
 };
 
+static void agStrokeAddPolygon(struct Path *outline, struct Vector2 *points, size_t count) {
+  double area = 0.0;
+
+  for (size_t i = 0; i < count; ++i) {
+    const struct Vector2 *a = &points[i];
+    const struct Vector2 *b = &points[(i + 1) % count];
+    area += a->x * b->y - b->x * a->y;
+  }
+
+  if (fabs(area) < DBL_EPSILON) {
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    size_t j = area > 0.0 ? i : count - 1 - i;
+    agPathAppend(outline, i == 0 ? AG_PATH_MOVE_TO : AG_PATH_LINE_TO, &points[j], 1);
+  }
+
+  agPathAppend(outline, AG_PATH_CLOSE, NULL, 0);
+}
+
+static void agStrokeAddCircle(struct Path *outline, struct Vector2 center, double radius) {
+  // four quarters with increasing angles, which gives the same orientation as agStrokeAddPolygon
+  static const double directions[5][2] = { { 1.0, 0.0 }, { 0.0, 1.0 }, { -1.0, 0.0 }, { 0.0, -1.0 }, { 1.0, 0.0 } };
+  const double k = AG_CIRCLE_KAPPA * radius;
+
+  agPathAppendPoint(outline, AG_PATH_MOVE_TO, center.x + radius, center.y);
+
+  for (int i = 0; i < 4; ++i) {
+    const double *from = directions[i];
+    const double *to = directions[i + 1];
+    struct Vector2 points[3] = {
+      { center.x + radius * from[0] - k * from[1], center.y + radius * from[1] + k * from[0] },
+      { center.x + radius * to[0] + k * to[1], center.y + radius * to[1] - k * to[0] },
+      { center.x + radius * to[0], center.y + radius * to[1] },
+    };
+    agPathAppend(outline, AG_PATH_CURVE_TO, points, 3);
+  }
+
+  agPathAppend(outline, AG_PATH_CLOSE, NULL, 0);
+}
+
+static void agStrokeAddCap(struct Path *outline, const struct StrokeStyle *style, struct Vector2 p, struct Vector2 direction) {
+  // direction is a unit vector pointing out of the path
+  switch (style->cap) {
+    case CAIRO_LINE_CAP_BUTT:
+      break;
+    case CAIRO_LINE_CAP_ROUND:
+      agStrokeAddCircle(outline, p, style->half_width);
+      break;
+    case CAIRO_LINE_CAP_SQUARE: {
+      double nx = -direction.y * style->half_width;
+      double ny = direction.x * style->half_width;
+      double dx = direction.x * style->half_width;
+      double dy = direction.y * style->half_width;
+      struct Vector2 points[4] = {
+        { p.x + nx, p.y + ny },
+        { p.x + nx + dx, p.y + ny + dy },
+        { p.x - nx + dx, p.y - ny + dy },
+        { p.x - nx, p.y - ny },
+      };
+      agStrokeAddPolygon(outline, points, 4);
+      break;
+    }
+  }
+}
+
+static void agStrokeAddJoin(struct Path *outline, const struct StrokeStyle *style, struct Vector2 p, struct Vector2 d0, struct Vector2 d1) {
+  double cross = d0.x * d1.y - d0.y * d1.x;
+  double dot = d0.x * d1.x + d0.y * d1.y;
+
+  if (fabs(cross) < 1e-9 && dot > 0.0) {
+    return;
+  }
+
+  if (style->join == CAIRO_LINE_JOIN_ROUND) {
+    agStrokeAddCircle(outline, p, style->half_width);
+    return;
+  }
+
+  // the join is on the outer side of the turn
+  double side = cross > 0.0 ? -style->half_width : style->half_width;
+  struct Vector2 n0 = { -d0.y, d0.x };
+  struct Vector2 n1 = { -d1.y, d1.x };
+  struct Vector2 a = { p.x + side * n0.x, p.y + side * n0.y };
+  struct Vector2 b = { p.x + side * n1.x, p.y + side * n1.y };
+
+  // same criterion as cairo: the ratio of the miter length to the line width
+  if (style->join == CAIRO_LINE_JOIN_MITER && dot > -1.0 + 1e-9 && sqrt(2.0 / (1.0 + dot)) <= style->miter_limit) {
+    struct Vector2 m = { p.x + side * (n0.x + n1.x) / (1.0 + dot), p.y + side * (n0.y + n1.y) / (1.0 + dot) };
+    struct Vector2 points[4] = { p, a, m, b };
+    agStrokeAddPolygon(outline, points, 4);
+    return;
+  }
+
+  struct Vector2 points[3] = { p, a, b };
+  agStrokeAddPolygon(outline, points, 3);
+}
+
+static struct Vector2 agStrokeDirection(struct Vector2 a, struct Vector2 b) {
+  double length = hypot(b.x - a.x, b.y - a.y);
+  struct Vector2 direction = { (b.x - a.x) / length, (b.y - a.y) / length };
+  return direction;
+}
+
+static void agStrokeSubpath(struct Path *outline, const struct StrokeStyle *style, const struct Vector2 *points, size_t count, bool closed) {
+  if (count == 0) {
+    return;
+  }
+
+  if (count == 1) {
+    // a degenerate subpath only shows its caps
+    if (style->cap == CAIRO_LINE_CAP_ROUND) {
+      agStrokeAddCircle(outline, points[0], style->half_width);
+    } else if (style->cap == CAIRO_LINE_CAP_SQUARE) {
+      struct Vector2 direction = { 1.0, 0.0 };
+      struct Vector2 opposite = { -1.0, 0.0 };
+      agStrokeAddCap(outline, style, points[0], direction);
+      agStrokeAddCap(outline, style, points[0], opposite);
+    }
+
+    return;
+  }
+
+  size_t segment_count = closed ? count : count - 1;
+
+  for (size_t i = 0; i < segment_count; ++i) {
+    struct Vector2 a = points[i];
+    struct Vector2 b = points[(i + 1) % count];
+    struct Vector2 d = agStrokeDirection(a, b);
+    double nx = -d.y * style->half_width;
+    double ny = d.x * style->half_width;
+    struct Vector2 quad[4] = {
+      { a.x + nx, a.y + ny },
+      { b.x + nx, b.y + ny },
+      { b.x - nx, b.y - ny },
+      { a.x - nx, a.y - ny },
+    };
+    agStrokeAddPolygon(outline, quad, 4);
+
+    if (i + 1 < segment_count || closed) {
+      struct Vector2 c = points[(i + 2) % count];
+      agStrokeAddJoin(outline, style, b, d, agStrokeDirection(b, c));
+    }
+  }
+
+  if (!closed) {
+    struct Vector2 start = agStrokeDirection(points[1], points[0]);
+    struct Vector2 end = agStrokeDirection(points[count - 2], points[count - 1]);
+    agStrokeAddCap(outline, style, points[0], start);
+    agStrokeAddCap(outline, style, points[count - 1], end);
+  }
+}
+
+static void agStrokeBuild(struct Path *outline, const struct Path *path, const struct StrokeStyle *style, double tolerance) {
+  struct Path flat;
+  agPathInit(&flat);
+  agPathBuildFlat(&flat, path, tolerance);
+
+  struct Vector2 *points = malloc((flat.point_count + 1) * sizeof(struct Vector2));
+  assert(points);
+  size_t count = 0;
+  size_t point = 0;
+  struct Vector2 start = { 0.0, 0.0 };
+  bool drawn = false; // a lone move_to is not stroked, even with caps
+
+  for (size_t i = 0; i < flat.command_count; ++i) {
+    switch (flat.commands[i]) {
+      case AG_PATH_MOVE_TO:
+        if (drawn) {
+          agStrokeSubpath(outline, style, points, count, false);
+        }
+
+        start = points[0] = flat.points[point++];
+        count = 1;
+        drawn = false;
+        break;
+      case AG_PATH_LINE_TO: {
+        const struct Vector2 *p = &flat.points[point++];
+
+        if (count == 0) {
+          // a line_to after a close starts from the closing point
+          points[count++] = start;
+        }
+
+        // consecutive identical points have no direction
+        if (p->x != points[count - 1].x || p->y != points[count - 1].y) {
+          points[count++] = *p;
+        }
+
+        drawn = true;
+        break;
+      }
+      default:
+        if (count > 1 && points[0].x == points[count - 1].x && points[0].y == points[count - 1].y) {
+          --count;
+        }
+
+        if (count > 0) {
+          agStrokeSubpath(outline, style, points, count, count > 1);
+        }
+
+        count = 0;
+        drawn = false;
+        break;
+    }
+  }
+
+  if (drawn) {
+    agStrokeSubpath(outline, style, points, count, false);
+  }
+
+  free(points);
+  agPathRelease(&flat);
+}
+
+// the tolerance of cr converted to the user space, along the direction the matrix stretches the most
+static double agStrokeUserTolerance(cairo_t *cr) {
+  cairo_matrix_t m;
+  cairo_get_matrix(cr, &m);
+
+  // major axis of the image of the unit circle
+  double a = m.xx * m.xx + m.yx * m.yx;
+  double b = m.xx * m.xy + m.yx * m.yy;
+  double c = m.xy * m.xy + m.yy * m.yy;
+  double major = sqrt(0.5 * (a + c) + hypot(0.5 * (a - c), b));
+
+  double tolerance = cairo_get_tolerance(cr) / major;
+  return tolerance > 0.0 && isfinite(tolerance) ? tolerance : AG_STROKE_TOLERANCE;
+}
+
+static struct Path *agStrokedPathGetOutline(struct StrokedPath *stroked, double tolerance) {
+  if (stroked->tolerance > 0.0 && stroked->tolerance <= tolerance) {
+    return &stroked->outline;
+  }
+
+  // finer than needed, so that a progressive zoom does not build it again at each frame
+  stroked->tolerance = 0.5 * tolerance;
+  agPathRelease(&stroked->outline);
+  agStrokeBuild(&stroked->outline, &stroked->path, &stroked->style, stroked->tolerance);
+  return &stroked->outline;
+}
+
 // class
 
-static ptrdiff_t agSurfaceAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return sizeof(struct Surface);
+static ptrdiff_t agStrokedPathAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct StrokedPath);
+}
+
+static uint64_t agStrokedPathTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_STROKED_TAG;
+}
+
+void agStrokedPathDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct StrokedPath *stroked = data;
+  agPathRelease(&stroked->path);
+  agPathRelease(&stroked->outline);
+}
+
+// methods
+
+static void agStrokedPathInit(AgateVM *vm, double miter_limit) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_STROKED_TAG);
+  struct StrokedPath *stroked = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 1);
+
+  double width = agSlotGetNumber(vm, 2);
+  int64_t cap = agateSlotGetInt(vm, 3);
+  int64_t join = agateSlotGetInt(vm, 4);
+
+  // released by the destructor even if the construction is aborted
+  agPathInit(&stroked->path);
+  agPathInit(&stroked->outline);
+  stroked->tolerance = 0.0;
+
+  const char *message = NULL;
+
+  if (!isfinite(width) || width < 0.0) {
+    message = "The width of the stroke must be a non-negative number";
+  } else if (!(miter_limit >= 1.0)) {
+    message = "The miter limit must be at least 1";
+  } else if (cap < CAIRO_LINE_CAP_BUTT || cap > CAIRO_LINE_CAP_SQUARE) {
+    message = "Unknown line cap";
+  } else if (join < CAIRO_LINE_JOIN_MITER || join > CAIRO_LINE_JOIN_BEVEL) {
+    message = "Unknown line join";
+  }
+
+  if (message != NULL) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, message);
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  stroked->style.half_width = 0.5 * width;
+  stroked->style.cap = (cairo_line_cap_t) cap;
+  stroked->style.join = (cairo_line_join_t) join;
+  stroked->style.miter_limit = miter_limit;
+
+  agPathCopy(&stroked->path, path);
+}
+
+static void agStrokedPathNew(AgateVM *vm) {
+  agStrokedPathInit(vm, AG_STROKE_MITER_LIMIT);
+}
+
+static void agStrokedPathNewWithMiterLimit(AgateVM *vm) {
+  agStrokedPathInit(vm, agSlotGetNumber(vm, 5));
+}
+
+static void agStrokedPathOutlineGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_STROKED_TAG);
+  struct StrokedPath *stroked = agateSlotGetForeign(vm, 0);
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Path *result = agSlotSetNewPath(vm, result_slot);
+  agPathCopy(result, agStrokedPathGetOutline(stroked, AG_STROKE_TOLERANCE));
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
 }
 
-static uint64_t agSurfaceTag(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return AG_SURFACE_TAG;
+/*
+ * Matrix
+ */
+
+// class
+
+static ptrdiff_t agMatrixAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(cairo_matrix_t);
+}
+
+static uint64_t agMatrixTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_MATRIX_TAG;
+}
+
+// methods
+
+static void agMatrixNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  cairo_matrix_init_identity(matrix);
+}
+
+static void agMatrixNewTranslate(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  double tx = agateSlotGetFloat(vm, 1);
+  double ty = agateSlotGetFloat(vm, 2);
+  cairo_matrix_init_translate(matrix, tx, ty);
+}
+
+static void agMatrixNewScale(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  double sx = agateSlotGetFloat(vm, 1);
+  double sy = agateSlotGetFloat(vm, 2);
+  cairo_matrix_init_scale(matrix, sx, sy);
+}
+
+static void agMatrixNewRotate(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  double angle = agateSlotGetFloat(vm, 1);
+  cairo_matrix_init_rotate(matrix, angle);
+}
+
+static void agMatrixTranslate(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  double tx = agateSlotGetFloat(vm, 1);
+  double ty = agateSlotGetFloat(vm, 2);
+  cairo_matrix_translate(matrix, tx, ty);
+}
+
+static void agMatrixScale(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  double sx = agateSlotGetFloat(vm, 1);
+  double sy = agateSlotGetFloat(vm, 2);
+  cairo_matrix_scale(matrix, sx, sy);
+}
+
+static void agMatrixRotate(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  double angle = agateSlotGetFloat(vm, 1);
+  cairo_matrix_rotate(matrix, angle);
+}
+
+static void agMatrixInvert(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+
+  if (cairo_matrix_invert(matrix) != CAIRO_STATUS_SUCCESS) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Unable to invert the matrix");
+    agateAbort(vm, string_slot);
+  }
+}
+
+static void agMatrixMultiply(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_MATRIX_TAG);
+  cairo_matrix_t *other = agateSlotGetForeign(vm, 1);
+
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Matrix", class_slot);
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  cairo_matrix_t *result = agateSlotSetForeign(vm, result_slot, class_slot);
+  cairo_matrix_multiply(result, matrix, other);
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+/*
+ * Color
+ */
+
+struct Color {
+  double r;
+  double g;
+  double b;
+  double a;
+};
+
+// class
+
+static ptrdiff_t agColorAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Color);
+}
+
+static uint64_t agColorTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_COLOR_TAG;
+}
+
+// methods
+
+static void agColorNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  color->r = agateSlotGetFloat(vm, 1);
+  color->g = agateSlotGetFloat(vm, 2);
+  color->b = agateSlotGetFloat(vm, 3);
+  color->a = agateSlotGetFloat(vm, 4);
+}
+
+static void agColorRGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->r);
+}
+
+static void agColorRSetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  color->r = agateSlotGetFloat(vm, 1);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->r);
+}
+
+static void agColorGGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->g);
+}
+
+static void agColorGSetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  color->g = agateSlotGetFloat(vm, 1);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->g);
+}
+
+static void agColorBGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->b);
+}
+
+static void agColorBSetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  color->b = agateSlotGetFloat(vm, 1);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->b);
+}
+
+static void agColorAGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->a);
+}
+
+static void agColorASetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  color->a = agateSlotGetFloat(vm, 1);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, color->a);
+}
+
+struct HSV {
+  double h;
+  double s;
+  double v;
+  double a;
+};
+
+static void agConvertRgbToHsv(struct HSV *hsv, const struct Color *color) {
+  const double r = color->r;
+  const double g = color->g;
+  const double b = color->b;
+
+  const double min = min3(color->r, color->g, color->b);
+  const double max = max3(color->r, color->g, color->b);
+
+  if ((max - min) > DBL_EPSILON) {
+    if (max == r) {
+      hsv->h = fmod(60 * (g - b) / (max - min) + 360, 360);
+    } else if (max == g) {
+      hsv->h = 60 * (b - r) / (max - min) + 120;
+    } else if (max == b) {
+      hsv->h = 60 * (r - g) / (max - min) + 240;
+    } else {
+      assert(false);
+    }
+  } else {
+    hsv->h = 0;
+  }
+
+  hsv->s = (max < DBL_EPSILON ? 0 : (1 - min / max));
+  hsv->v = max;
+  hsv->a = color->a;
+}
+
+static void agConvertHsvToRgb(struct Color *color, const struct HSV *hsv) {
+  const double h = hsv->h / 60;
+  const double s = hsv->s;
+  const double v = hsv->v;
+
+  const int i = ((int) h) % 6;
+  assert(0 <= i && i < 6);
+
+  const double f = h - (double) i;
+  const double x = v * (1 - s);
+  const double y = v * (1 - (f * s));
+  const double z = v * (1 - (1 - f) * s);
+
+  switch (i) {
+    case 0: color->r = v; color->g = z; color->b = x; break;
+    case 1: color->r = y; color->g = v; color->b = x; break;
+    case 2: color->r = x; color->g = v; color->b = z; break;
+    case 3: color->r = x; color->g = y; color->b = v; break;
+    case 4: color->r = z; color->g = x; color->b = v; break;
+    case 5: color->r = v; color->g = x; color->b = y; break;
+    default: assert(false); break;
+  }
+
+  color->a = hsv->a;
+}
+
+static void agColorDarker(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  double percent = agateSlotGetFloat(vm, 1);
+
+  struct HSV hsv;
+  agConvertRgbToHsv(&hsv, color);
+  hsv.v -= hsv.v * percent;
+  agConvertHsvToRgb(color, &hsv);
+}
+
+static void agColorLighter(AgateVM* vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 0);
+  double percent = agateSlotGetFloat(vm, 1);
+
+  struct HSV hsv;
+  agConvertRgbToHsv(&hsv, color);
+  hsv.v += hsv.v * percent;
+
+  if (hsv.v > 1) {
+    hsv.s -= (hsv.v - 1);
+
+    if (hsv.s < 0) {
+      hsv.s = 0;
+    }
+
+    hsv.v = 1;
+  }
+
+  agConvertHsvToRgb(color, &hsv);
+}
+
+/*
+ * ImageCache
+ */
+
+struct ImageCacheEntry {
+  char *filename;
+  struct timespec mtime; // with the size, a file rewritten within the same second is detected
+  off_t size;
+  cairo_surface_t *surface;
+  size_t bytes;
+  uint64_t last_use;
+};
+
+// process-wide, decoded images are shared between surfaces until written
+static struct {
+  struct ImageCacheEntry *entries;
+  size_t count;
+  size_t capacity;
+  size_t bytes;
+  size_t budget;
+  uint64_t clock;
+} g_image_cache = { NULL, 0, 0, 0, AG_IMAGE_CACHE_BUDGET, 0 };
+
+static void agImageCacheRemove(size_t i) {
+  struct ImageCacheEntry *entry = &g_image_cache.entries[i];
+  g_image_cache.bytes -= entry->bytes;
+  free(entry->filename);
+  cairo_surface_destroy(entry->surface);
+  g_image_cache.entries[i] = g_image_cache.entries[--g_image_cache.count];
+}
+
+static void agImageCacheTrim(void) {
+  while (g_image_cache.bytes > g_image_cache.budget) {
+    assert(g_image_cache.count > 0);
+    size_t oldest = 0;
+
+    for (size_t i = 1; i < g_image_cache.count; ++i) {
+      if (g_image_cache.entries[i].last_use < g_image_cache.entries[oldest].last_use) {
+        oldest = i;
+      }
+    }
+
+    agImageCacheRemove(oldest);
+  }
+}
+
+// returns a new reference, shared with the cache when cached is true
+static cairo_surface_t *agImageCacheLoad(const char *filename, bool *cached) {
+  *cached = false;
+  struct stat info;
+
+  if (stat(filename, &info) != 0) {
+    // let cairo report the error
+    return cairo_image_surface_create_from_png(filename);
+  }
+
+  for (size_t i = 0; i < g_image_cache.count; ++i) {
+    struct ImageCacheEntry *entry = &g_image_cache.entries[i];
+
+    if (!equals(entry->filename, filename)) {
+      continue;
+    }
+
+    if (entry->mtime.tv_sec == info.st_mtim.tv_sec && entry->mtime.tv_nsec == info.st_mtim.tv_nsec && entry->size == info.st_size) {
+      entry->last_use = ++g_image_cache.clock;
+      *cached = true;
+      return cairo_surface_reference(entry->surface);
+    }
+
+    agImageCacheRemove(i);
+    break;
+  }
+
+  cairo_surface_t *surface = cairo_image_surface_create_from_png(filename);
+
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    return surface;
+  }
+
+  size_t bytes = (size_t) cairo_image_surface_get_stride(surface) * (size_t) cairo_image_surface_get_height(surface);
+
+  if (bytes > g_image_cache.budget) {
+    return surface;
+  }
+
+  if (g_image_cache.count == g_image_cache.capacity) {
+    g_image_cache.capacity = g_image_cache.capacity == 0 ? 16 : 2 * g_image_cache.capacity;
+    g_image_cache.entries = realloc(g_image_cache.entries, g_image_cache.capacity * sizeof(struct ImageCacheEntry));
+    assert(g_image_cache.entries);
+  }
+
+  struct ImageCacheEntry *entry = &g_image_cache.entries[g_image_cache.count++];
+  size_t length = strlen(filename);
+  entry->filename = malloc(length + 1);
+  assert(entry->filename);
+  memcpy(entry->filename, filename, length + 1);
+  entry->mtime = info.st_mtim;
+  entry->size = info.st_size;
+  entry->surface = cairo_surface_reference(surface);
+  entry->bytes = bytes;
+  entry->last_use = ++g_image_cache.clock;
+  g_image_cache.bytes += bytes;
+
+  agImageCacheTrim();
+
+  *cached = true;
+  return surface;
+}
+
+/*
+ * Resampling
+ */
+
+enum ResampleFilter {
+  AG_RESAMPLE_BOX,
+  AG_RESAMPLE_BILINEAR,
+  AG_RESAMPLE_LANCZOS,
+};
+
+static double agResampleSinc(double x) {
+  if (fabs(x) < 1e-8) {
+    return 1.0;
+  }
+
+  x *= AG_PI;
+  return sin(x) / x;
+}
+
+static double agResampleKernel(enum ResampleFilter filter, double x) {
+  x = fabs(x);
+
+  switch (filter) {
+    case AG_RESAMPLE_BOX:
+      return x <= 0.5 ? 1.0 : 0.0;
+    case AG_RESAMPLE_BILINEAR:
+      return x < 1.0 ? 1.0 - x : 0.0;
+    case AG_RESAMPLE_LANCZOS:
+      return x < 3.0 ? agResampleSinc(x) * agResampleSinc(x / 3.0) : 0.0;
+  }
+
+  return 0.0;
+}
+
+static double agResampleSupport(enum ResampleFilter filter) {
+  switch (filter) {
+    case AG_RESAMPLE_BOX:
+      return 0.5;
+    case AG_RESAMPLE_BILINEAR:
+      return 1.0;
+    case AG_RESAMPLE_LANCZOS:
+      return 3.0;
+  }
+
+  return 1.0;
+}
+
+// the weights of the input samples for each output sample along one axis
+struct ResampleAxis {
+  int *first;
+  int *count;
+  int stride; // maximum number of weights per output sample
+  float *weights;
+};
+
+static void agResampleAxisInit(struct ResampleAxis *axis, enum ResampleFilter filter, int input_size, int output_size) {
+  double scale = (double) input_size / (double) output_size;
+  double filter_scale = scale > 1.0 ? scale : 1.0;
+  double support = agResampleSupport(filter) * filter_scale;
+
+  axis->stride = (int) ceil(2.0 * support) + 2;
+  axis->first = malloc((size_t) output_size * sizeof(int));
+  axis->count = malloc((size_t) output_size * sizeof(int));
+  axis->weights = calloc((size_t) output_size * (size_t) axis->stride, sizeof(float));
+  assert(axis->first && axis->count && axis->weights);
+
+  for (int i = 0; i < output_size; ++i) {
+    double center = (i + 0.5) * scale;
+    int left = (int) floor(center - support);
+    int right = (int) ceil(center + support);
+
+    if (left < 0) {
+      left = 0;
+    }
+
+    if (right > input_size) {
+      right = input_size;
+    }
+
+    if (right - left > axis->stride) {
+      right = left + axis->stride;
+    }
+
+    float *weights = axis->weights + (size_t) i * (size_t) axis->stride;
+    double total = 0.0;
+
+    for (int j = left; j < right; ++j) {
+      double weight = agResampleKernel(filter, (j + 0.5 - center) / filter_scale);
+      weights[j - left] = (float) weight;
+      total += weight;
+    }
+
+    if (total == 0.0) {
+      // upscaling with a box filter may fall between samples, use the nearest one
+      int nearest = (int) center;
+      left = nearest < input_size ? nearest : input_size - 1;
+      right = left + 1;
+      weights[0] = 1.0f;
+      total = 1.0;
+    }
+
+    for (int j = 0; j < right - left; ++j) {
+      weights[j] = (float) (weights[j] / total);
+    }
+
+    axis->first[i] = left;
+    axis->count[i] = right - left;
+  }
+}
+
+static void agResampleAxisRelease(struct ResampleAxis *axis) {
+  free(axis->first);
+  free(axis->count);
+  free(axis->weights);
+}
+
+struct ResampleJob {
+  const unsigned char *src;
+  int src_width;
+  int src_stride;
+  unsigned char *dst;
+  int dst_width;
+  int dst_stride;
+  int channels;
+  int alpha_channel; // -1 if there is no alpha
+  struct ResampleAxis horizontal;
+  struct ResampleAxis vertical;
+  // horizontally resampled input rows of dst_width * channels, input row y is at y % ring_rows
+  float *ring;
+  int ring_rows;
+  int offset; // first row of the current parallel pass
+};
+
+static void agResampleHorizontal(void *data, size_t begin, size_t end) {
+  struct ResampleJob *job = data;
+  const int channels = job->channels;
+
+  for (size_t i = begin; i < end; ++i) {
+    size_t y = (size_t) job->offset + i;
+    const unsigned char *src = job->src + y * (size_t) job->src_stride;
+    float *tmp = job->ring + (y % (size_t) job->ring_rows) * (size_t) job->dst_width * (size_t) channels;
+
+    for (int x = 0; x < job->dst_width; ++x) {
+      const float *weights = job->horizontal.weights + (size_t) x * (size_t) job->horizontal.stride;
+      const unsigned char *samples = src + (size_t) job->horizontal.first[x] * (size_t) channels;
+      float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+      for (int j = 0; j < job->horizontal.count[x]; ++j) {
+        for (int c = 0; c < channels; ++c) {
+          sum[c] += weights[j] * samples[j * channels + c];
+        }
+      }
+
+      for (int c = 0; c < channels; ++c) {
+        tmp[x * channels + c] = sum[c];
+      }
+    }
+  }
+}
+
+static inline unsigned char agResampleClamp(float value, float max) {
+  if (value <= 0.0f) {
+    return 0;
+  }
+
+  if (value >= max) {
+    return (unsigned char) max;
+  }
+
+  return (unsigned char) (value + 0.5f);
+}
+
+static void agResampleVertical(void *data, size_t begin, size_t end) {
+  struct ResampleJob *job = data;
+  const int channels = job->channels;
+  const size_t row_size = (size_t) job->dst_width * (size_t) channels;
+
+  float *sum = malloc(row_size * sizeof(float));
+  assert(sum);
+
+  for (size_t i = begin; i < end; ++i) {
+    size_t y = (size_t) job->offset + i;
+    const float *weights = job->vertical.weights + y * (size_t) job->vertical.stride;
+
+    memset(sum, 0, row_size * sizeof(float));
+
+    // whole rows at a time, so that the compiler vectorizes the inner loop
+    for (int j = 0; j < job->vertical.count[y]; ++j) {
+      const float weight = weights[j];
+      const float *row = job->ring + ((size_t) (job->vertical.first[y] + j) % (size_t) job->ring_rows) * row_size;
+
+      for (size_t i = 0; i < row_size; ++i) {
+        sum[i] += weight * row[i];
+      }
+    }
+
+    unsigned char *dst = job->dst + y * (size_t) job->dst_stride;
+
+    if (job->alpha_channel < 0) {
+      for (size_t i = 0; i < row_size; ++i) {
+        dst[i] = agResampleClamp(sum[i], 255.0f);
+      }
+    } else {
+      // premultiplied colors can not exceed the alpha after a filter with negative lobes
+      for (int x = 0; x < job->dst_width; ++x) {
+        float *pixel = sum + x * channels;
+        unsigned char alpha = agResampleClamp(pixel[job->alpha_channel], 255.0f);
+
+        for (int c = 0; c < channels; ++c) {
+          dst[x * channels + c] = c == job->alpha_channel ? alpha : agResampleClamp(pixel[c], alpha);
+        }
+      }
+    }
+  }
+
+  free(sum);
+}
+
+static cairo_surface_t *agResample(cairo_surface_t *input, int width, int height, enum ResampleFilter filter) {
+  cairo_format_t format = cairo_image_surface_get_format(input);
+  int channels = format == CAIRO_FORMAT_A8 ? 1 : 4;
+
+  if (width < 1 || height < 1 || width > AG_IMAGE_MAX_SIZE || height > AG_IMAGE_MAX_SIZE || (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_A8)) {
+    return NULL;
+  }
+
+  cairo_surface_flush(input);
+  cairo_surface_t *output = cairo_image_surface_create(format, width, height);
+
+  if (cairo_surface_status(output) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(output);
+    return NULL;
+  }
+
+  struct ResampleJob job;
+  job.src = cairo_image_surface_get_data(input);
+  job.src_width = cairo_image_surface_get_width(input);
+  job.src_stride = cairo_image_surface_get_stride(input);
+  job.dst = cairo_image_surface_get_data(output);
+  job.dst_width = width;
+  job.dst_stride = cairo_image_surface_get_stride(output);
+  job.channels = channels;
+  job.alpha_channel = -1;
+
+  int src_height = cairo_image_surface_get_height(input);
+
+  if (job.src == NULL || job.src_width < 1 || src_height < 1) {
+    cairo_surface_destroy(output);
+    return NULL;
+  }
+
+  if (format == CAIRO_FORMAT_ARGB32) {
+    // alpha is the most significant byte of the native endian pixel
+    const uint32_t probe = 1;
+    job.alpha_channel = *(const unsigned char *) &probe == 1 ? 3 : 0;
+  } else if (format == CAIRO_FORMAT_A8) {
+    job.alpha_channel = 0;
+  }
+
+  agResampleAxisInit(&job.horizontal, filter, job.src_width, width);
+  agResampleAxisInit(&job.vertical, filter, src_height, height);
+
+  // the output is computed in bands of rows, the input rows of a band fit in the ring
+  size_t row_memory = (size_t) width * (size_t) channels * sizeof(float);
+  size_t ring_rows = AG_RESAMPLE_RING_MEMORY / row_memory;
+
+  if (ring_rows < (size_t) job.vertical.stride) {
+    ring_rows = (size_t) job.vertical.stride;
+  }
+
+  if (ring_rows > (size_t) src_height) {
+    ring_rows = (size_t) src_height;
+  }
+
+  job.ring_rows = (int) ring_rows;
+  size_t grain = (size_t) max2i(1, AG_RESAMPLE_GRAIN_PIXELS / max2i(width, job.src_width));
+  job.ring = malloc(ring_rows * row_memory);
+  assert(job.ring);
+
+  int valid_begin = 0; // the input rows currently in the ring
+  int valid_end = 0;
+
+  for (int y = 0; y < height; ) {
+    int band_begin = job.vertical.first[y];
+    int band_end = band_begin + job.vertical.count[y];
+    int band_height = 1;
+
+    while (y + band_height < height) {
+      int first = min2i(band_begin, job.vertical.first[y + band_height]);
+      int last = max2i(band_end, job.vertical.first[y + band_height] + job.vertical.count[y + band_height]);
+
+      if (last - first > job.ring_rows) {
+        break;
+      }
+
+      band_begin = first;
+      band_end = last;
+      ++band_height;
+    }
+
+    if (band_begin < valid_begin || band_begin >= valid_end) {
+      valid_begin = valid_end = band_begin;
+    }
+
+    if (band_end > valid_end) {
+      job.offset = valid_end;
+      agParallelFor((size_t) (band_end - valid_end), grain, agResampleHorizontal, &job);
+      valid_end = band_end;
+      valid_begin = max2i(valid_begin, valid_end - job.ring_rows);
+    }
+
+    job.offset = y;
+    agParallelFor((size_t) band_height, grain, agResampleVertical, &job);
+    y += band_height;
+  }
+
+  free(job.ring);
+  agResampleAxisRelease(&job.horizontal);
+  agResampleAxisRelease(&job.vertical);
+
+  cairo_surface_mark_dirty(output);
+  return output;
+}
+
+/*
+ * Compositing
+ */
+
+// blends of premultiplied pixels, the loops are kept simple enough to be vectorized by the compiler
+
+static inline uint32_t agDiv255(uint32_t x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t agBlendOver(uint32_t s, uint32_t d, uint32_t sa, uint32_t da) {
+  return s + agDiv255(d * (255 - sa));
+}
+
+static inline uint32_t agBlendAdd(uint32_t s, uint32_t d, uint32_t sa, uint32_t da) {
+  uint32_t sum = s + d;
+  return sum > 255 ? 255 : sum;
+}
+
+static inline uint32_t agBlendMultiply(uint32_t s, uint32_t d, uint32_t sa, uint32_t da) {
+  return agDiv255(s * d + s * (255 - da) + d * (255 - sa));
+}
+
+static inline uint32_t agBlendScreen(uint32_t s, uint32_t d, uint32_t sa, uint32_t da) {
+  return s + d - agDiv255(s * d);
+}
+
+typedef uint32_t (*AgBlendFunc)(uint32_t s, uint32_t d, uint32_t sa, uint32_t da);
+
+// inlined in a row function per operator: the blend is a constant, there is no branch left in the loop
+static inline void agCompositeRowARGB32(uint32_t *dst, const uint32_t *src, int width, uint32_t alpha, AgBlendFunc blend, AgBlendFunc blend_alpha) {
+  for (int x = 0; x < width; ++x) {
+    uint32_t s = src[x];
+    uint32_t d = dst[x];
+    uint32_t sa = agDiv255((s >> 24) * alpha);
+    uint32_t sr = agDiv255(((s >> 16) & 0xFF) * alpha);
+    uint32_t sg = agDiv255(((s >> 8) & 0xFF) * alpha);
+    uint32_t sb = agDiv255((s & 0xFF) * alpha);
+    uint32_t da = d >> 24;
+    uint32_t dr = (d >> 16) & 0xFF;
+    uint32_t dg = (d >> 8) & 0xFF;
+    uint32_t db = d & 0xFF;
+
+    dst[x] = blend_alpha(sa, da, sa, da) << 24 | blend(sr, dr, sa, da) << 16 | blend(sg, dg, sa, da) << 8 | blend(sb, db, sa, da);
+  }
+}
+
+static inline void agCompositeRowA8(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha, AgBlendFunc blend_alpha) {
+  for (int x = 0; x < width; ++x) {
+    uint32_t s = agDiv255(src[x] * alpha);
+    uint32_t d = dst[x];
+    dst[x] = (unsigned char) blend_alpha(s, d, s, d);
+  }
+}
+
+typedef void (*AgCompositeRowFunc)(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha);
+
+// for the alpha channel, multiply and screen both give the union of the coverages
+
+static void agCompositeOverARGB32(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowARGB32((uint32_t *) dst, (const uint32_t *) src, width, alpha, agBlendOver, agBlendOver);
+}
+
+static void agCompositeAddARGB32(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowARGB32((uint32_t *) dst, (const uint32_t *) src, width, alpha, agBlendAdd, agBlendAdd);
+}
+
+static void agCompositeMultiplyARGB32(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowARGB32((uint32_t *) dst, (const uint32_t *) src, width, alpha, agBlendMultiply, agBlendScreen);
+}
+
+static void agCompositeScreenARGB32(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowARGB32((uint32_t *) dst, (const uint32_t *) src, width, alpha, agBlendScreen, agBlendScreen);
+}
+
+static void agCompositeOverA8(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowA8(dst, src, width, alpha, agBlendOver);
+}
+
+static void agCompositeAddA8(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowA8(dst, src, width, alpha, agBlendAdd);
+}
+
+static void agCompositeScreenA8(unsigned char *dst, const unsigned char *src, int width, uint32_t alpha) {
+  agCompositeRowA8(dst, src, width, alpha, agBlendScreen);
+}
+
+// NULL if the operator has no fast path
+static AgCompositeRowFunc agCompositeRowFunc(cairo_operator_t op, cairo_format_t format) {
+  bool argb32 = format == CAIRO_FORMAT_ARGB32;
+
+  switch (op) {
+    case CAIRO_OPERATOR_OVER:
+      return argb32 ? agCompositeOverARGB32 : agCompositeOverA8;
+    case CAIRO_OPERATOR_ADD:
+      return argb32 ? agCompositeAddARGB32 : agCompositeAddA8;
+    case CAIRO_OPERATOR_MULTIPLY:
+      return argb32 ? agCompositeMultiplyARGB32 : agCompositeScreenA8;
+    case CAIRO_OPERATOR_SCREEN:
+      return argb32 ? agCompositeScreenARGB32 : agCompositeScreenA8;
+    default:
+      return NULL;
+  }
+}
+
+struct CompositeJob {
+  AgCompositeRowFunc row;
+  uint32_t alpha;
+  unsigned char *dst;
+  int dst_stride;
+  const unsigned char *src;
+  int src_stride;
+  int width;
+};
+
+static void agCompositeRows(void *data, size_t begin, size_t end) {
+  struct CompositeJob *job = data;
+
+  for (size_t y = begin; y < end; ++y) {
+    job->row(job->dst + y * (size_t) job->dst_stride, job->src + y * (size_t) job->src_stride, job->width, job->alpha);
+  }
+}
+
+// returns false when the fast path does not apply
+static bool agComposite(cairo_surface_t *dst, cairo_surface_t *src, double x, double y, cairo_operator_t op, double alpha) {
+  if (dst == src || cairo_surface_get_type(dst) != CAIRO_SURFACE_TYPE_IMAGE || cairo_surface_get_type(src) != CAIRO_SURFACE_TYPE_IMAGE) {
+    return false;
+  }
+
+  cairo_format_t format = cairo_image_surface_get_format(dst);
+
+  if ((format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_A8) || cairo_image_surface_get_format(src) != format) {
+    return false;
+  }
+
+  AgCompositeRowFunc row = agCompositeRowFunc(op, format);
+
+  if (row == NULL || x != floor(x) || y != floor(y) || !(alpha >= 0.0 && alpha <= 1.0)) {
+    return false;
+  }
+
+  int dst_width = cairo_image_surface_get_width(dst);
+  int dst_height = cairo_image_surface_get_height(dst);
+  int src_width = cairo_image_surface_get_width(src);
+  int src_height = cairo_image_surface_get_height(src);
+
+  // nothing to draw, and the offset may not fit in an int
+  if (x >= dst_width || y >= dst_height || x + src_width <= 0.0 || y + src_height <= 0.0) {
+    return true;
+  }
+
+  int x1 = (int) max2(x, 0.0);
+  int y1 = (int) max2(y, 0.0);
+  int x2 = (int) min2(x + src_width, dst_width);
+  int y2 = (int) min2(y + src_height, dst_height);
+
+  cairo_surface_flush(src);
+  cairo_surface_flush(dst);
+
+  struct CompositeJob job;
+  job.row = row;
+  job.alpha = (uint32_t) (alpha * 255.0 + 0.5);
+  job.dst_stride = cairo_image_surface_get_stride(dst);
+  job.src_stride = cairo_image_surface_get_stride(src);
+  size_t pixel_size = format == CAIRO_FORMAT_ARGB32 ? 4 : 1;
+  job.dst = cairo_image_surface_get_data(dst) + (size_t) y1 * job.dst_stride + (size_t) x1 * pixel_size;
+  job.src = cairo_image_surface_get_data(src) + (size_t) (y1 - (int) y) * job.src_stride + (size_t) (x1 - (int) x) * pixel_size;
+  job.width = x2 - x1;
+
+  // small layers are not worth the threads
+  size_t grain = max2(AG_PARALLEL_GRAIN, AG_COMPOSITE_GRAIN_PIXELS / job.width);
+  agParallelFor((size_t) (y2 - y1), grain, agCompositeRows, &job);
+
+  cairo_surface_mark_dirty_rectangle(dst, x1, y1, x2 - x1, y2 - y1);
+  return true;
+}
+
+/*
+ * Surface
+ */
+
+struct Surface {
+  cairo_surface_t *ptr;
+  FILE *stream; // for vector surfaces, owned by the cairo surface
+  bool shared; // pixels owned by the image cache
+  size_t band_memory; // for banded surfaces, the most pixel memory used at once on export
+};
+
+// copy on write for surfaces shared with the image cache
+static void agSurfaceMakeWritable(struct Surface *surface) {
+  if (!surface->shared) {
+    return;
+  }
+
+  surface->shared = false;
+
+  if (cairo_surface_get_reference_count(surface->ptr) == 1) {
+    return;
+  }
+
+  cairo_surface_t *shared = surface->ptr;
+  cairo_surface_flush(shared);
+
+  int width = cairo_image_surface_get_width(shared);
+  int height = cairo_image_surface_get_height(shared);
+  cairo_format_t format = cairo_image_surface_get_format(shared);
+  surface->ptr = cairo_image_surface_create(format, width, height);
+
+  int src_stride = cairo_image_surface_get_stride(shared);
+  int dst_stride = cairo_image_surface_get_stride(surface->ptr);
+  int row_size = src_stride < dst_stride ? src_stride : dst_stride;
+  const unsigned char *src = cairo_image_surface_get_data(shared);
+  unsigned char *dst = cairo_image_surface_get_data(surface->ptr);
+
+  for (int y = 0; y < height; ++y) {
+    memcpy(dst + (ptrdiff_t) y * dst_stride, src + (ptrdiff_t) y * src_stride, (size_t) row_size);
+  }
+
+  cairo_surface_mark_dirty(surface->ptr);
+  cairo_surface_destroy(shared);
+}
+
+static cairo_status_t agSurfaceWrite(void *closure, const unsigned char *data, unsigned int length) {
+  FILE *stream = closure;
+
+  if (fwrite(data, 1, length, stream) != length) {
+    return CAIRO_STATUS_WRITE_ERROR;
+  }
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+static FILE *agSurfaceOpenStream(const char *filename) {
+  if (equals(filename, "-")) {
+    return stdout;
+  }
+
+  return fopen(filename, "wb");
+}
+
+static bool agSurfaceGetSize(cairo_surface_t *ptr, int *width, int *height) {
+  if (cairo_surface_get_type(ptr) == CAIRO_SURFACE_TYPE_IMAGE) {
+    *width = cairo_image_surface_get_width(ptr);
+    *height = cairo_image_surface_get_height(ptr);
+    return true;
+  }
+
+  cairo_rectangle_t extents;
+
+  if (cairo_surface_get_type(ptr) == CAIRO_SURFACE_TYPE_RECORDING && cairo_recording_surface_get_extents(ptr, &extents)
+      && extents.width <= INT_MAX && extents.height <= INT_MAX) {
+    *width = (int) ceil(extents.width);
+    *height = (int) ceil(extents.height);
+    return true;
+  }
+
+  return false;
+}
+
+// the stream is closed with the last reference to the cairo surface, a Context may outlive the Surface
+static const cairo_user_data_key_t g_stream_key;
+
+static void agSurfaceStreamRelease(void *data) {
+  FILE *stream = data;
+
+  if (stream == stdout) {
+    fflush(stdout);
+  } else {
+    fclose(stream);
+  }
+}
+
+static void agSurfaceOwnStream(struct Surface *surface) {
+  cairo_status_t status = cairo_surface_set_user_data(surface->ptr, &g_stream_key, surface->stream, agSurfaceStreamRelease);
+
+  if (status != CAIRO_STATUS_SUCCESS) {
+    agSurfaceStreamRelease(surface->stream);
+    surface->stream = NULL;
+  }
+}
+
+static void agSurfaceCloseStream(struct Surface *surface) {
+  if (surface->stream == NULL) {
+    return;
+  }
+
+  // replacing the user data releases the stream
+  cairo_surface_finish(surface->ptr);
+  cairo_surface_set_user_data(surface->ptr, &g_stream_key, NULL, NULL);
+  surface->stream = NULL;
+}
+
+// generations identify the content of a cairo object in the damage hashes, a pointer can be reused after a free
+static const cairo_user_data_key_t g_generation_key;
+static uintptr_t g_generation = 0;
+
+static uintptr_t agSurfaceGeneration(cairo_surface_t *ptr) {
+  uintptr_t generation = (uintptr_t) cairo_surface_get_user_data(ptr, &g_generation_key);
+
+  if (generation == 0) {
+    // if it can not be stored, the next hash takes another generation and does not match
+    generation = ++g_generation;
+    cairo_surface_set_user_data(ptr, &g_generation_key, (void *) generation, NULL);
+  }
+
+  return generation;
+}
+
+// called before each change of the content, the next hash takes a new generation
+static void agSurfaceTouch(cairo_surface_t *ptr) {
+  cairo_surface_set_user_data(ptr, &g_generation_key, NULL, NULL);
+}
+
+// class
+
+static ptrdiff_t agSurfaceAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Surface);
+}
+
+static uint64_t agSurfaceTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_SURFACE_TAG;
+}
+
+void agSurfaceDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Surface *surface = data;
+
+  if (surface->ptr != NULL) {
+    cairo_surface_destroy(surface->ptr);
+  }
+
+  surface->ptr = NULL;
+}
+
+// methods
+
+static void agSurfaceNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+  surface->ptr = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size->x, size->y);
+  surface->stream = NULL;
+  surface->shared = false;
+  surface->band_memory = 0;
+  assert(surface->ptr);
+}
+
+static void agSurfaceNewFromPng(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  const char *filename = agateSlotGetString(vm, 1);
+  surface->ptr = agImageCacheLoad(filename, &surface->shared);
+  surface->stream = NULL;
+  surface->band_memory = 0;
+  assert(surface->ptr);
+}
+
+static void agSurfaceSetImageCacheBudget(AgateVM *vm) {
+  int64_t budget = agateSlotGetInt(vm, 1);
+  g_image_cache.budget = budget < 0 ? 0 : (size_t) budget;
+  agImageCacheTrim();
+}
+
+static bool agSurfaceNewVector(AgateVM *vm, struct Surface *surface, const char *filename) {
+  surface->ptr = NULL;
+  surface->shared = false;
+  surface->band_memory = 0;
+  surface->stream = agSurfaceOpenStream(filename);
+
+  if (surface->stream == NULL) {
+    // keep a valid surface so that the object can still be used and destroyed
+    surface->ptr = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Unable to open the output file");
+    agateAbort(vm, string_slot);
+    return false;
+  }
+
+  return true;
+}
+
+static void agSurfaceNewSvg(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  const char *filename = agateSlotGetString(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 2);
+
+  if (agSurfaceNewVector(vm, surface, filename)) {
+    surface->ptr = cairo_svg_surface_create_for_stream(agSurfaceWrite, surface->stream, size->x, size->y);
+    agSurfaceOwnStream(surface);
+  }
+
+  assert(surface->ptr);
+}
+
+static void agSurfaceNewPdf(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  const char *filename = agateSlotGetString(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 2);
+
+  if (agSurfaceNewVector(vm, surface, filename)) {
+    surface->ptr = cairo_pdf_surface_create_for_stream(agSurfaceWrite, surface->stream, size->x, size->y);
+    agSurfaceOwnStream(surface);
+  }
+
+  assert(surface->ptr);
+}
+
+static void agSurfaceNewRecording(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+  cairo_rectangle_t extents = { 0.0, 0.0, size->x, size->y };
+  surface->ptr = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  surface->stream = NULL;
+  surface->shared = false;
+  surface->band_memory = 0;
+  assert(surface->ptr);
+}
+
+static void agSurfaceNewBanded(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+  int64_t memory = agateSlotGetInt(vm, 2);
+
+  // drawn into a recording surface, rasterized band by band on export
+  cairo_rectangle_t extents = { 0.0, 0.0, floor(size->x), floor(size->y) };
+  surface->ptr = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  surface->stream = NULL;
+  surface->shared = false;
+  surface->band_memory = memory > 0 ? (size_t) memory : 1;
+  assert(surface->ptr);
+}
+
+static void agSurfaceShowPage(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  cairo_surface_show_page(surface->ptr);
+
+  // the page is complete in the stream, do not keep it in memory
+  if (surface->stream != NULL) {
+    fflush(surface->stream);
+  }
+}
+
+static void agSurfaceSetPageSize(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+
+  if (cairo_surface_get_type(surface->ptr) == CAIRO_SURFACE_TYPE_PDF) {
+    cairo_pdf_surface_set_size(surface->ptr, size->x, size->y);
+  }
+}
+
+static void agSurfaceFinish(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  agSurfaceCloseStream(surface);
+}
+
+static void agSurfaceSizeGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Vector2", class_slot);
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Vector2 *size = agateSlotSetForeign(vm, result_slot, class_slot);
+  int width = 0;
+  int height = 0;
+  agSurfaceGetSize(surface->ptr, &width, &height);
+  size->x = width;
+  size->y = height;
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+static void agSurfaceSetNew(AgateVM *vm, ptrdiff_t slot, cairo_surface_t *ptr) {
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Surface", class_slot);
+
+  struct Surface *surface = agateSlotSetForeign(vm, slot, class_slot);
+  surface->ptr = ptr;
+  surface->stream = NULL;
+  surface->shared = false;
+  surface->band_memory = 0;
+}
+
+static void agSurfaceResize(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+  int64_t filter = agateSlotGetInt(vm, 2);
+
+  if (filter < AG_RESAMPLE_BOX || filter > AG_RESAMPLE_LANCZOS) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Unknown resample filter");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  cairo_surface_t *resized = NULL;
+
+  bool valid_size = size->x >= 1.0 && size->x <= AG_IMAGE_MAX_SIZE && size->y >= 1.0 && size->y <= AG_IMAGE_MAX_SIZE;
+
+  if (valid_size && cairo_surface_get_type(surface->ptr) == CAIRO_SURFACE_TYPE_IMAGE) {
+    resized = agResample(surface->ptr, (int) size->x, (int) size->y, (enum ResampleFilter) filter);
+  }
+
+  if (resized == NULL) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Unable to resize the surface");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  agSurfaceSetNew(vm, result_slot, resized);
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+static void agSurfaceBuildMipmaps(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+
+  ptrdiff_t array_slot = agateSlotAllocate(vm);
+  agateSlotArrayNew(vm, array_slot);
+
+  if (cairo_surface_get_type(surface->ptr) != CAIRO_SURFACE_TYPE_IMAGE) {
+    agateSlotCopy(vm, AGATE_RETURN_SLOT, array_slot);
+    return;
+  }
+
+  ptrdiff_t level_slot = agateSlotAllocate(vm);
+  cairo_surface_t *level = surface->ptr;
+  int width = cairo_image_surface_get_width(level);
+  int height = cairo_image_surface_get_height(level);
+
+  // each level is a 2x2 box filter of the previous one
+  while (width > 1 || height > 1) {
+    width = width > 1 ? (width + 1) / 2 : 1;
+    height = height > 1 ? (height + 1) / 2 : 1;
+    level = agResample(level, width, height, AG_RESAMPLE_BOX);
+
+    if (level == NULL) {
+      break;
+    }
+
+    agSurfaceSetNew(vm, level_slot, level);
+    agateSlotArrayInsert(vm, array_slot, -1, level_slot);
+  }
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, array_slot);
+}
+
+// bands
+
+enum BandFormat {
+  AG_BAND_PNG,
+  AG_BAND_PAM,
+};
+
+static void agUnpremultiplyRow(const uint32_t *src, unsigned char *dst, int width) {
+  for (int x = 0; x < width; ++x) {
+    uint32_t pixel = src[x];
+    uint32_t a = pixel >> 24;
+
+    if (a == 0) {
+      dst[4 * x + 0] = dst[4 * x + 1] = dst[4 * x + 2] = dst[4 * x + 3] = 0;
+      continue;
+    }
+
+    dst[4 * x + 0] = (unsigned char) ((((pixel >> 16) & 0xFF) * 255 + a / 2) / a);
+    dst[4 * x + 1] = (unsigned char) ((((pixel >> 8) & 0xFF) * 255 + a / 2) / a);
+    dst[4 * x + 2] = (unsigned char) (((pixel & 0xFF) * 255 + a / 2) / a);
+    dst[4 * x + 3] = (unsigned char) a;
+  }
+}
+
+static void agOpaqueRow(const uint32_t *src, unsigned char *dst, int width) {
+  for (int x = 0; x < width; ++x) {
+    uint32_t pixel = src[x];
+    dst[4 * x + 0] = (unsigned char) ((pixel >> 16) & 0xFF);
+    dst[4 * x + 1] = (unsigned char) ((pixel >> 8) & 0xFF);
+    dst[4 * x + 2] = (unsigned char) (pixel & 0xFF);
+    dst[4 * x + 3] = 255;
+  }
+}
+
+static void agAlphaRow(const unsigned char *src, unsigned char *dst, int width) {
+  for (int x = 0; x < width; ++x) {
+    dst[4 * x + 0] = dst[4 * x + 1] = dst[4 * x + 2] = 0;
+    dst[4 * x + 3] = src[x];
+  }
+}
+
+// the pixels of an image surface are read directly, other surfaces are replayed in bands
+static bool agBandCanReadImage(cairo_surface_t *source) {
+  if (cairo_surface_get_type(source) != CAIRO_SURFACE_TYPE_IMAGE) {
+    return false;
+  }
+
+  cairo_format_t format = cairo_image_surface_get_format(source);
+  return format == CAIRO_FORMAT_ARGB32 || format == CAIRO_FORMAT_RGB24 || format == CAIRO_FORMAT_A8;
+}
+
+static void agBandReadImageRow(cairo_surface_t *source, int y, unsigned char *row) {
+  const unsigned char *data = cairo_image_surface_get_data(source) + (size_t) y * cairo_image_surface_get_stride(source);
+  int width = cairo_image_surface_get_width(source);
+
+  switch (cairo_image_surface_get_format(source)) {
+    case CAIRO_FORMAT_RGB24:
+      agOpaqueRow((const uint32_t *) data, row, width);
+      break;
+    case CAIRO_FORMAT_A8:
+      agAlphaRow(data, row, width);
+      break;
+    default:
+      agUnpremultiplyRow((const uint32_t *) data, row, width);
+      break;
+  }
+}
+
+// a band is split in columns, cairo refuses image surfaces wider than AG_IMAGE_MAX_SIZE
+struct Band {
+  cairo_surface_t **columns; // NULL when the source is an image
+  size_t column_count;
+  int height;
+};
+
+static void agBandReplay(const struct Band *band, cairo_surface_t *source, int y) {
+  for (size_t i = 0; i < band->column_count; ++i) {
+    // replayed with the extents of the column, cairo culls the commands outside of it
+    cairo_t *cr = cairo_create(band->columns[i]);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    cairo_set_source_surface(cr, source, -(double) i * AG_IMAGE_MAX_SIZE, -(double) y);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(band->columns[i]);
+  }
+}
+
+static void agBandReadRow(const struct Band *band, int i, unsigned char *row) {
+  for (size_t j = 0; j < band->column_count; ++j) {
+    cairo_surface_t *column = band->columns[j];
+    const unsigned char *data = cairo_image_surface_get_data(column) + (size_t) i * cairo_image_surface_get_stride(column);
+    agUnpremultiplyRow((const uint32_t *) data, row + j * AG_IMAGE_MAX_SIZE * 4, cairo_image_surface_get_width(column));
+  }
+}
+
+// may not return if libpng fails, the caller owns every resource
+static bool agSurfaceWriteBands(cairo_surface_t *source, const struct Band *band, int width, int height, unsigned char *row, FILE *stream, png_structp png, png_infop info) {
+  if (png != NULL) {
+    png_init_io(png, stream);
+    png_set_IHDR(png, info, (png_uint_32) width, (png_uint_32) height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+  } else {
+    fprintf(stream, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+  }
+
+  for (int y = 0; y < height; y += band->height) {
+    if (band->columns != NULL) {
+      agBandReplay(band, source, y);
+    }
+
+    int rows = height - y < band->height ? height - y : band->height;
+
+    for (int i = 0; i < rows; ++i) {
+      if (band->columns != NULL) {
+        agBandReadRow(band, i, row);
+      } else {
+        agBandReadImageRow(source, y + i, row);
+      }
+
+      if (png != NULL) {
+        png_write_row(png, row);
+      } else if (fwrite(row, 4, (size_t) width, stream) != (size_t) width) {
+        return false;
+      }
+    }
+  }
+
+  if (png != NULL) {
+    png_write_end(png, NULL);
+  }
+
+  return true;
+}
+
+// peak pixel memory is one band of at most memory bytes, whatever the size of the surface
+static bool agSurfaceExportBands(cairo_surface_t *source, const char *filename, enum BandFormat format, size_t memory) {
+  int width;
+  int height;
+
+  if (!agSurfaceGetSize(source, &width, &height) || width <= 0 || height <= 0) {
+    return false;
+  }
+
+  struct Band band = { NULL, 0, height };
+  bool ok = true;
+
+  if (agBandCanReadImage(source)) {
+    cairo_surface_flush(source);
+  } else {
+    size_t band_height = memory / ((size_t) width * 4);
+
+    if (band_height < 1) {
+      band_height = 1;
+    } else if (band_height > (size_t) min2i(height, AG_IMAGE_MAX_SIZE)) {
+      band_height = (size_t) min2i(height, AG_IMAGE_MAX_SIZE);
+    }
+
+    band.height = (int) band_height;
+    band.column_count = ((size_t) width + AG_IMAGE_MAX_SIZE - 1) / AG_IMAGE_MAX_SIZE;
+    band.columns = malloc(band.column_count * sizeof(cairo_surface_t *));
+    assert(band.columns);
+
+    for (size_t i = 0; i < band.column_count; ++i) {
+      int column_width = min2i(width - (int) i * AG_IMAGE_MAX_SIZE, AG_IMAGE_MAX_SIZE);
+      band.columns[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, column_width, band.height);
+      ok = ok && cairo_surface_status(band.columns[i]) == CAIRO_STATUS_SUCCESS;
+    }
+  }
+
+  FILE *stream = ok ? agSurfaceOpenStream(filename) : NULL;
+  unsigned char *row = malloc((size_t) width * 4);
+  assert(row);
+
+  if (stream == NULL) {
+    ok = false;
+  } else if (format == AG_BAND_PNG) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png != NULL ? png_create_info_struct(png) : NULL;
+
+    if (info == NULL) {
+      ok = false;
+    } else if (setjmp(png_jmpbuf(png)) == 0) {
+      ok = agSurfaceWriteBands(source, &band, width, height, row, stream, png, info);
+    } else {
+      // libpng jumps back here on error
+      ok = false;
+    }
+
+    png_destroy_write_struct(&png, info != NULL ? &info : NULL);
+  } else {
+    ok = agSurfaceWriteBands(source, &band, width, height, row, stream, NULL, NULL);
+  }
+
+  free(row);
+
+  for (size_t i = 0; i < band.column_count; ++i) {
+    cairo_surface_destroy(band.columns[i]);
+  }
+
+  free(band.columns);
+
+  if (stream == stdout) {
+    ok = fflush(stdout) == 0 && ok;
+  } else if (stream != NULL) {
+    ok = fclose(stream) == 0 && ok;
+  }
+
+  return ok;
+}
+
+static void agSurfaceExport(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  const char *filename = agateSlotGetString(vm, 1);
+
+  if (surface->band_memory > 0) {
+    if (!agSurfaceExportBands(surface->ptr, filename, AG_BAND_PNG, surface->band_memory)) {
+      fprintf(stderr, "Error: unable to export '%s'\n", filename);
+    }
+
+    return;
+  }
+
+  cairo_status_t status = cairo_surface_write_to_png(surface->ptr, filename);
+
+  if (status != CAIRO_STATUS_SUCCESS) {
+    fprintf(stderr, "Error: %s\n", cairo_status_to_string(status));
+  }
+}
+
+static void agSurfaceComposite(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
+  struct Surface *source = agateSlotGetForeign(vm, 1);
+  double x = agSlotGetNumber(vm, 2);
+  double y = agSlotGetNumber(vm, 3);
+  cairo_operator_t op = (cairo_operator_t) agateSlotGetInt(vm, 4);
+  double alpha = agSlotGetNumber(vm, 5);
+
+  agSurfaceMakeWritable(surface);
+  agSurfaceTouch(surface->ptr);
+
+  if (agComposite(surface->ptr, source->ptr, x, y, op, alpha)) {
+    return;
+  }
+
+  cairo_t *cr = cairo_create(surface->ptr);
+  cairo_set_operator(cr, op);
+  cairo_set_source_surface(cr, source->ptr, x, y);
+  cairo_paint_with_alpha(cr, alpha);
+  cairo_destroy(cr);
+}
+
+static void agSurfaceExportRaw(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  const char *filename = agateSlotGetString(vm, 1);
+  size_t memory = surface->band_memory > 0 ? surface->band_memory : SIZE_MAX;
+
+  if (!agSurfaceExportBands(surface->ptr, filename, AG_BAND_PAM, memory)) {
+    fprintf(stderr, "Error: unable to export '%s'\n", filename);
+  }
+}
+
+// tiles
+
+// creates the directory and its parents, like mkdir -p
+static bool agMakeDirectories(const char *path) {
+  char *copy = strdup(path);
+  assert(copy);
+  bool ok = true;
+
+  // the root of an absolute path is not created
+  for (char *p = copy[0] == '/' ? copy + 1 : copy; ok; ++p) {
+    if (*p != '/' && *p != '\0') {
+      continue;
+    }
+
+    char c = *p;
+    *p = '\0';
+    ok = mkdir(copy, 0777) == 0 || errno == EEXIST;
+    *p = c;
+
+    if (c == '\0') {
+      break;
+    }
+  }
+
+  free(copy);
+  return ok;
+}
+
+// replaying a recording is not thread-safe, tiles are replayed one by one then encoded in parallel, a batch at a time
+struct TileBatch {
+  const char *directory;
+  int zoom;
+  cairo_surface_t *surfaces[AG_TILE_BATCH];
+  int x[AG_TILE_BATCH];
+  int y[AG_TILE_BATCH];
+  bool written[AG_TILE_BATCH];
+};
+
+static bool agTileIsEmpty(cairo_surface_t *surface) {
+  const unsigned char *data = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+
+  for (int y = 0; y < AG_TILE_SIZE; ++y) {
+    const uint32_t *row = (const uint32_t *) (data + (size_t) y * stride);
+
+    for (int x = 0; x < AG_TILE_SIZE; ++x) {
+      if (row[x] != 0) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+// the recording is replayed with the target extents, commands outside the tile are culled by cairo
+static void agTileReplay(cairo_surface_t *surface, cairo_surface_t *recording, double world_x, double world_y, double scale, int x, int y) {
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  cairo_paint(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+  cairo_translate(cr, -(double) x * AG_TILE_SIZE, -(double) y * AG_TILE_SIZE);
+  cairo_scale(cr, scale, scale);
+  cairo_translate(cr, -world_x, -world_y);
+  cairo_set_source_surface(cr, recording, 0.0, 0.0);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  cairo_surface_flush(surface);
+}
+
+static void agTileWrite(void *data, size_t begin, size_t end) {
+  struct TileBatch *batch = data;
+  size_t length = strlen(batch->directory) + 64;
+  char *filename = malloc(length);
+  assert(filename);
+
+  for (size_t i = begin; i < end; ++i) {
+    batch->written[i] = false;
+
+    if (agTileIsEmpty(batch->surfaces[i])) {
+      continue;
+    }
+
+    snprintf(filename, length, "%s/%d/%d", batch->directory, batch->zoom, batch->x[i]);
+
+    if (!agMakeDirectories(filename)) {
+      fprintf(stderr, "Error: unable to create '%s'\n", filename);
+      continue;
+    }
+
+    snprintf(filename, length, "%s/%d/%d/%d.png", batch->directory, batch->zoom, batch->x[i], batch->y[i]);
+    cairo_status_t status = cairo_surface_write_to_png(batch->surfaces[i], filename);
+
+    if (status != CAIRO_STATUS_SUCCESS) {
+      fprintf(stderr, "Error: %s\n", cairo_status_to_string(status));
+      continue;
+    }
+
+    batch->written[i] = true;
+  }
+
+  free(filename);
+}
+
+static int64_t agTileFlush(struct TileBatch *batch, size_t count) {
+  agParallelFor(count, 1, agTileWrite, batch);
+  int64_t written = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    written += batch->written[i] ? 1 : 0;
+  }
+
+  return written;
+}
+
+static void agSurfaceExportTiles(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 0);
+  const char *directory = agateSlotGetString(vm, 1);
+  int64_t zoom_min = agateSlotGetInt(vm, 2);
+  int64_t zoom_max = agateSlotGetInt(vm, 3);
+
+  if (cairo_surface_get_type(surface->ptr) != CAIRO_SURFACE_TYPE_RECORDING) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Tiles are exported from a recording surface");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  if (directory[0] == '\0') {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "The tile directory must not be empty");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  if (zoom_min < 0 || zoom_max < zoom_min || zoom_max > AG_TILE_MAX_ZOOM) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Invalid zoom range");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  double ink_x, ink_y, ink_width, ink_height;
+  cairo_recording_surface_ink_extents(surface->ptr, &ink_x, &ink_y, &ink_width, &ink_height);
+
+  // the whole world fits in one tile at zoom 0
+  double world_x, world_y, world_size;
+  cairo_rectangle_t world;
+
+  if (cairo_recording_surface_get_extents(surface->ptr, &world)) {
+    world_x = world.x;
+    world_y = world.y;
+    world_size = max2(world.width, world.height);
+  } else {
+    world_x = ink_x;
+    world_y = ink_y;
+    world_size = max2(ink_width, ink_height);
+  }
+
+  if (ink_width <= 0.0 || ink_height <= 0.0 || world_size <= 0.0) {
+    agateSlotSetInt(vm, AGATE_RETURN_SLOT, 0);
+    return;
+  }
+
+  if (!agMakeDirectories(directory)) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Unable to create the tile directory");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  struct TileBatch batch;
+  batch.directory = directory;
+
+  for (size_t i = 0; i < AG_TILE_BATCH; ++i) {
+    batch.surfaces[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, AG_TILE_SIZE, AG_TILE_SIZE);
+    assert(cairo_surface_status(batch.surfaces[i]) == CAIRO_STATUS_SUCCESS);
+  }
+
+  int64_t written = 0;
+
+  for (int zoom = (int) zoom_min; zoom <= (int) zoom_max; ++zoom) {
+    // only the tiles that intersect the ink are rendered
+    double tiles = ldexp(1.0, zoom);
+    double scale = ldexp(AG_TILE_SIZE, zoom) / world_size;
+    int x1 = (int) min2(max2(floor((ink_x - world_x) * scale / AG_TILE_SIZE), 0.0), tiles);
+    int y1 = (int) min2(max2(floor((ink_y - world_y) * scale / AG_TILE_SIZE), 0.0), tiles);
+    int x2 = (int) max2(min2(ceil((ink_x + ink_width - world_x) * scale / AG_TILE_SIZE), tiles), 0.0);
+    int y2 = (int) max2(min2(ceil((ink_y + ink_height - world_y) * scale / AG_TILE_SIZE), tiles), 0.0);
+
+    batch.zoom = zoom;
+    size_t count = 0;
+
+    for (int y = y1; y < y2; ++y) {
+      for (int x = x1; x < x2; ++x) {
+        agTileReplay(batch.surfaces[count], surface->ptr, world_x, world_y, scale, x, y);
+        batch.x[count] = x;
+        batch.y[count] = y;
+
+        if (++count == AG_TILE_BATCH) {
+          written += agTileFlush(&batch, count);
+          count = 0;
+        }
+      }
+    }
+
+    written += agTileFlush(&batch, count);
+  }
+
+  for (size_t i = 0; i < AG_TILE_BATCH; ++i) {
+    cairo_surface_destroy(batch.surfaces[i]);
+  }
+
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, written);
+}
+
+/*
+ * Pattern
+ */
+
+struct Pattern {
+  cairo_pattern_t *ptr;
+};
+
+// class
+
+static ptrdiff_t agPatternAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Pattern);
+}
+
+static uint64_t agPatternTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_PATTERN_TAG;
+}
+
+void agPatternDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Pattern *pattern = data;
+
+  if (pattern->ptr != NULL) {
+    cairo_pattern_destroy(pattern->ptr);
+  }
+
+  pattern->ptr = NULL;
+}
+
+// methods
+
+static void agPatternSetMatrix(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 1);
+  cairo_pattern_set_matrix(pattern->ptr, matrix);
+}
+
+static void agPatternSetExtend(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+  cairo_pattern_set_extend(pattern->ptr, (cairo_extend_t) raw);
+}
+
+static void agSolidPatternNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 1);
+  pattern->ptr = cairo_pattern_create_rgba(color->r, color->g, color->b, color->a);
+}
+
+static void agSurfacePatternNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 1);
+  pattern->ptr = cairo_pattern_create_for_surface(surface->ptr);
+}
+
+static void agSurfacePatternSetFilter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+  cairo_pattern_set_filter(pattern->ptr, (cairo_filter_t) raw);
+}
+
+static void agGradientPatternAddColor(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  double offset = agateSlotGetFloat(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 2);
+  cairo_pattern_add_color_stop_rgba(pattern->ptr, offset, color->r, color->g, color->b, color->a);
+}
+
+static void agLinearGradientPatternNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *p0 = agateSlotGetForeign(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_VECTOR2_TAG);
+  struct Vector2 *p1 = agateSlotGetForeign(vm, 2);
+  pattern->ptr = cairo_pattern_create_linear(p0->x, p0->y, p1->x, p1->y);
+}
+
+static void agRadialGradientPatternNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *c0 = agateSlotGetForeign(vm, 1);
+  double r0 = agateSlotGetFloat(vm, 2);
+  assert(agateSlotGetForeignTag(vm, 3) == AG_VECTOR2_TAG);
+  struct Vector2 *c1 = agateSlotGetForeign(vm, 3);
+  double r1 = agateSlotGetFloat(vm, 4);
+  pattern->ptr = cairo_pattern_create_radial(c0->x, c0->y, r0, c1->x, c1->y, r1);
+}
+
+/*
+ * SpriteAtlas
+ */
+
+struct Sprite {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct SpriteAtlas {
+  cairo_surface_t *ptr;
+  int width;
+  int height;
+  // shelf packing
+  int shelf_x;
+  int shelf_y;
+  int shelf_height;
+  struct Sprite *sprites;
+  size_t count;
+  size_t capacity;
+};
+
+static bool agSpriteAtlasPack(struct SpriteAtlas *atlas, int width, int height, struct Sprite *sprite) {
+  int padded_width = width + 2 * AG_SPRITE_PADDING;
+  int padded_height = height + 2 * AG_SPRITE_PADDING;
+
+  if (atlas->shelf_x + padded_width > atlas->width) {
+    atlas->shelf_x = 0;
+    atlas->shelf_y += atlas->shelf_height;
+    atlas->shelf_height = 0;
+  }
+
+  if (padded_width > atlas->width || atlas->shelf_y + padded_height > atlas->height) {
+    return false;
+  }
+
+  sprite->x = atlas->shelf_x + AG_SPRITE_PADDING;
+  sprite->y = atlas->shelf_y + AG_SPRITE_PADDING;
+  sprite->width = width;
+  sprite->height = height;
+
+  atlas->shelf_x += padded_width;
+
+  if (padded_height > atlas->shelf_height) {
+    atlas->shelf_height = padded_height;
+  }
+
+  return true;
+}
+
+// class
+
+static ptrdiff_t agSpriteAtlasAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct SpriteAtlas);
+}
+
+static uint64_t agSpriteAtlasTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_ATLAS_TAG;
+}
+
+void agSpriteAtlasDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct SpriteAtlas *atlas = data;
+
+  if (atlas->ptr != NULL) {
+    cairo_surface_destroy(atlas->ptr);
+  }
+
+  free(atlas->sprites);
+  atlas->ptr = NULL;
+  atlas->sprites = NULL;
+}
+
+// methods
+
+static void agSpriteAtlasNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_ATLAS_TAG);
+  struct SpriteAtlas *atlas = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+  atlas->width = (int) size->x;
+  atlas->height = (int) size->y;
+  atlas->ptr = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, atlas->width, atlas->height);
+  atlas->shelf_x = atlas->shelf_y = atlas->shelf_height = 0;
+  atlas->sprites = NULL;
+  atlas->count = atlas->capacity = 0;
+  assert(atlas->ptr);
+}
+
+static void agSpriteAtlasAdd(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_ATLAS_TAG);
+  struct SpriteAtlas *atlas = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 1);
+
+  struct Sprite sprite;
+
+  if (cairo_surface_get_type(surface->ptr) != CAIRO_SURFACE_TYPE_IMAGE
+      || !agSpriteAtlasPack(atlas, cairo_image_surface_get_width(surface->ptr), cairo_image_surface_get_height(surface->ptr), &sprite)) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Unable to add the surface to the atlas");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  agSurfaceTouch(atlas->ptr);
+  cairo_t *cr = cairo_create(atlas->ptr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, surface->ptr, sprite.x, sprite.y);
+  cairo_rectangle(cr, sprite.x, sprite.y, sprite.width, sprite.height);
+  cairo_fill(cr);
+  cairo_destroy(cr);
+
+  if (atlas->count == atlas->capacity) {
+    atlas->capacity = atlas->capacity == 0 ? 16 : 2 * atlas->capacity;
+    atlas->sprites = realloc(atlas->sprites, atlas->capacity * sizeof(struct Sprite));
+    assert(atlas->sprites);
+  }
+
+  atlas->sprites[atlas->count] = sprite;
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, (int64_t) atlas->count);
+  ++atlas->count;
+}
+
+static void agSpriteAtlasCountGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_ATLAS_TAG);
+  struct SpriteAtlas *atlas = agateSlotGetForeign(vm, 0);
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, (int64_t) atlas->count);
+}
+
+/*
+ * Heatmap
+ */
+
+// points are splatted with a gaussian kernel in a float grid, then the grid goes through a color ramp
+
+struct Heatmap {
+  int width;
+  int height;
+  int radius;
+  float *grid;
+  float *kernel; // (2 * radius + 1)^2 weights
+};
+
+struct HeatmapSplat {
+  int x;
+  int y;
+  float weight;
+};
+
+struct HeatmapSplatJob {
+  struct Heatmap *heatmap;
+  const struct HeatmapSplat *splats;
+  const size_t *offsets; // splats of band b are indices[offsets[b]..offsets[b + 1]]
+  const size_t *indices;
+};
+
+static void agHeatmapSplatBands(void *data, size_t begin, size_t end) {
+  struct HeatmapSplatJob *job = data;
+  struct Heatmap *heatmap = job->heatmap;
+  const int radius = heatmap->radius;
+  const int size = 2 * radius + 1;
+
+  // each band only writes its own rows, no synchronization needed
+  for (size_t band = begin; band < end; ++band) {
+    int band_y1 = (int) band * AG_HEATMAP_BAND;
+    int band_y2 = min2i(band_y1 + AG_HEATMAP_BAND, heatmap->height);
+
+    for (size_t k = job->offsets[band]; k < job->offsets[band + 1]; ++k) {
+      const struct HeatmapSplat *splat = &job->splats[job->indices[k]];
+      int y1 = max2i(splat->y - radius, band_y1);
+      int y2 = min2i(splat->y + radius + 1, band_y2);
+      int x1 = max2i(splat->x - radius, 0);
+      int x2 = min2i(splat->x + radius + 1, heatmap->width);
+
+      for (int y = y1; y < y2; ++y) {
+        float *row = heatmap->grid + (size_t) y * heatmap->width;
+        const float *kernel = heatmap->kernel + (size_t) (y - splat->y + radius) * size + (x1 - splat->x + radius);
+
+        for (int x = x1; x < x2; ++x) {
+          row[x] += splat->weight * kernel[x - x1];
+        }
+      }
+    }
+  }
+}
+
+static void agHeatmapSplat(struct Heatmap *heatmap, const struct HeatmapSplat *splats, size_t count) {
+  size_t band_count = (size_t) (heatmap->height + AG_HEATMAP_BAND - 1) / AG_HEATMAP_BAND;
+  size_t *offsets = calloc(band_count + 1, sizeof(size_t));
+  assert(offsets);
+
+  // a splat goes in every band its kernel touches
+  for (size_t i = 0; i < count; ++i) {
+    size_t first = (size_t) max2i(splats[i].y - heatmap->radius, 0) / AG_HEATMAP_BAND;
+    size_t last = (size_t) min2i(splats[i].y + heatmap->radius, heatmap->height - 1) / AG_HEATMAP_BAND;
+
+    for (size_t band = first; band <= last; ++band) {
+      ++offsets[band + 1];
+    }
+  }
+
+  for (size_t band = 0; band < band_count; ++band) {
+    offsets[band + 1] += offsets[band];
+  }
+
+  size_t *indices = malloc((offsets[band_count] + 1) * sizeof(size_t));
+  size_t *cursors = malloc((band_count + 1) * sizeof(size_t));
+  assert(indices && cursors);
+  memcpy(cursors, offsets, band_count * sizeof(size_t));
+
+  for (size_t i = 0; i < count; ++i) {
+    size_t first = (size_t) max2i(splats[i].y - heatmap->radius, 0) / AG_HEATMAP_BAND;
+    size_t last = (size_t) min2i(splats[i].y + heatmap->radius, heatmap->height - 1) / AG_HEATMAP_BAND;
+
+    for (size_t band = first; band <= last; ++band) {
+      indices[cursors[band]++] = i;
+    }
+  }
+
+  struct HeatmapSplatJob job = { heatmap, splats, offsets, indices };
+  agParallelFor(band_count, 1, agHeatmapSplatBands, &job);
+
+  free(cursors);
+  free(indices);
+  free(offsets);
+}
+
+static float agHeatmapMax(const struct Heatmap *heatmap) {
+  float max = 0.0f;
+  size_t size = (size_t) heatmap->width * heatmap->height;
+
+  for (size_t i = 0; i < size; ++i) {
+    if (heatmap->grid[i] > max) {
+      max = heatmap->grid[i];
+    }
+  }
+
+  return max;
+}
+
+struct HeatmapColorizeJob {
+  const struct Heatmap *heatmap;
+  const uint32_t *ramp;
+  double scale;
+  unsigned char *data;
+  int stride;
+};
+
+static void agHeatmapColorizeRows(void *data, size_t begin, size_t end) {
+  struct HeatmapColorizeJob *job = data;
+  const struct Heatmap *heatmap = job->heatmap;
+
+  for (size_t y = begin; y < end; ++y) {
+    const float *values = heatmap->grid + y * (size_t) heatmap->width;
+    uint32_t *pixels = (uint32_t *) (job->data + y * (size_t) job->stride);
+
+    for (int x = 0; x < heatmap->width; ++x) {
+      double index = values[x] * job->scale;
+      pixels[x] = job->ramp[!(index > 0.0) ? 0 : (index >= AG_HEATMAP_RAMP_SIZE - 1 ? AG_HEATMAP_RAMP_SIZE - 1 : (int) (index + 0.5))];
+    }
+  }
+}
+
+// class
+
+static ptrdiff_t agHeatmapAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Heatmap);
+}
+
+static uint64_t agHeatmapTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_HEATMAP_TAG;
+}
+
+void agHeatmapDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Heatmap *heatmap = data;
+  free(heatmap->grid);
+  free(heatmap->kernel);
+  heatmap->grid = NULL;
+  heatmap->kernel = NULL;
+}
+
+// methods
+
+static void agHeatmapNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_HEATMAP_TAG);
+  struct Heatmap *heatmap = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 1);
+  double radius = agSlotGetNumber(vm, 2);
+
+  heatmap->grid = NULL;
+  heatmap->kernel = NULL;
+
+  if (!(size->x >= 1.0 && size->x <= AG_IMAGE_MAX_SIZE && size->y >= 1.0 && size->y <= AG_IMAGE_MAX_SIZE)) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "The size of the heatmap must be between 1 and 32767");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  // the kernel has (2 * radius + 1)^2 weights
+  if (!(radius >= 0.0 && radius <= max2(size->x, size->y))) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "The radius of the heatmap must be between 0 and its size");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  heatmap->width = (int) size->x;
+  heatmap->height = (int) size->y;
+  heatmap->radius = (int) ceil(radius);
+  heatmap->grid = calloc((size_t) heatmap->width * heatmap->height, sizeof(float));
+  assert(heatmap->grid);
+
+  // the kernel vanishes at the radius, like the edge of a soft circle
+  // the value of the gaussian at the radius is subtracted, otherwise the cut leaves a visible ring
+  int kernel_size = 2 * heatmap->radius + 1;
+  double sigma = max2(0.5 * radius, 0.5);
+  double r2 = max2(radius, 0.0) * max2(radius, 0.0);
+  double tail = exp(-0.5 * r2 / (sigma * sigma));
+  heatmap->kernel = malloc((size_t) kernel_size * kernel_size * sizeof(float));
+  assert(heatmap->kernel);
+
+  for (int y = 0; y < kernel_size; ++y) {
+    for (int x = 0; x < kernel_size; ++x) {
+      double dx = x - heatmap->radius;
+      double dy = y - heatmap->radius;
+      double d2 = dx * dx + dy * dy;
+      float weight = 0.0f;
+
+      if (d2 == 0.0) {
+        weight = 1.0f;
+      } else if (d2 < r2) {
+        weight = (float) ((exp(-0.5 * d2 / (sigma * sigma)) - tail) / (1.0 - tail));
+      }
+
+      heatmap->kernel[y * kernel_size + x] = weight;
+    }
+  }
+}
+
+static void agHeatmapAddPoints(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_HEATMAP_TAG);
+  struct Heatmap *heatmap = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 4) == AG_MATRIX_TAG);
+  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 4);
+
+  struct FloatView xs, ys;
+
+  if (!agSlotGetFloatColumns(vm, 1, &xs, &ys)) {
+    return;
+  }
+
+  struct FloatView weights = { NULL, 0, NULL };
+
+  if (agateSlotType(vm, 3) != AGATE_TYPE_NIL) {
+    agSlotGetFloatView(vm, 3, &weights);
+
+    if (weights.size != xs.size) {
+      agFloatViewRelease(&weights);
+      agFloatViewRelease(&xs);
+      agFloatViewRelease(&ys);
+      ptrdiff_t string_slot = agateSlotAllocate(vm);
+      agateSlotSetString(vm, string_slot, "Columns of different sizes");
+      agateAbort(vm, string_slot);
+      return;
+    }
+  }
+
+  struct HeatmapSplat *splats = malloc((xs.size + 1) * sizeof(struct HeatmapSplat));
+  assert(splats);
+  size_t count = 0;
+
+  for (size_t i = 0; i < xs.size; ++i) {
+    double x = xs.data[i];
+    double y = ys.data[i];
+    cairo_matrix_transform_point(matrix, &x, &y);
+
+    // the kernel is centered on the pixel containing the point
+    if (!(x > -heatmap->radius - 1 && x < heatmap->width + heatmap->radius + 1 && y > -heatmap->radius - 1 && y < heatmap->height + heatmap->radius + 1)) {
+      continue;
+    }
+
+    double weight = weights.data != NULL ? weights.data[i] : 1.0;
+
+    // a negative or infinite weight would make the grid meaningless for the color ramp
+    if (!(weight > 0.0 && weight <= FLT_MAX)) {
+      continue;
+    }
+
+    struct HeatmapSplat *splat = &splats[count];
+    splat->x = (int) floor(x);
+    splat->y = (int) floor(y);
+    splat->weight = (float) weight;
+
+    if (splat->y + heatmap->radius >= 0 && splat->y - heatmap->radius < heatmap->height) {
+      ++count;
+    }
+  }
+
+  agHeatmapSplat(heatmap, splats, count);
+
+  free(splats);
+  agFloatViewRelease(&weights);
+  agFloatViewRelease(&xs);
+  agFloatViewRelease(&ys);
+}
+
+static void agHeatmapClear(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_HEATMAP_TAG);
+  struct Heatmap *heatmap = agateSlotGetForeign(vm, 0);
+  memset(heatmap->grid, 0, (size_t) heatmap->width * heatmap->height * sizeof(float));
+}
+
+static void agHeatmapMaxGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_HEATMAP_TAG);
+  struct Heatmap *heatmap = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, agHeatmapMax(heatmap));
+}
+
+static void agHeatmapColorize(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_HEATMAP_TAG);
+  struct Heatmap *heatmap = agateSlotGetForeign(vm, 0);
+  double max = agSlotGetNumber(vm, 2);
+
+  ptrdiff_t stop_count = agateSlotArraySize(vm, 1);
+  ptrdiff_t element_slot = agateSlotAllocate(vm);
+
+  if (stop_count == 0) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "The color ramp is empty");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  struct Color *stops = malloc((size_t) stop_count * sizeof(struct Color));
+  assert(stops);
+
+  for (ptrdiff_t i = 0; i < stop_count; ++i) {
+    agateSlotArrayGet(vm, 1, i, element_slot);
+
+    if (agateSlotType(vm, element_slot) != AGATE_TYPE_FOREIGN || agateSlotGetForeignTag(vm, element_slot) != AG_COLOR_TAG) {
+      free(stops);
+      ptrdiff_t string_slot = agateSlotAllocate(vm);
+      agateSlotSetString(vm, string_slot, "The color ramp must only contain colors");
+      agateAbort(vm, string_slot);
+      return;
+    }
+
+    stops[i] = *(struct Color *) agateSlotGetForeign(vm, element_slot);
+  }
+
+  // evenly spaced stops, sampled in a premultiplied lookup table
+  uint32_t ramp[AG_HEATMAP_RAMP_SIZE];
+
+  for (int i = 0; i < AG_HEATMAP_RAMP_SIZE; ++i) {
+    double t = (double) i / (AG_HEATMAP_RAMP_SIZE - 1) * (double) (stop_count - 1);
+    ptrdiff_t stop = (ptrdiff_t) t < stop_count - 1 ? (ptrdiff_t) t : stop_count - 1;
+    ptrdiff_t next = stop + 1 < stop_count ? stop + 1 : stop;
+    double f = t - (double) stop;
+    // an out of range component would carry into the neighbour channel
+    double a = clamp01(stops[stop].a + f * (stops[next].a - stops[stop].a));
+    double r = clamp01(stops[stop].r + f * (stops[next].r - stops[stop].r)) * a;
+    double g = clamp01(stops[stop].g + f * (stops[next].g - stops[stop].g)) * a;
+    double b = clamp01(stops[stop].b + f * (stops[next].b - stops[stop].b)) * a;
+    ramp[i] = (uint32_t) (a * 255.0 + 0.5) << 24 | (uint32_t) (r * 255.0 + 0.5) << 16 | (uint32_t) (g * 255.0 + 0.5) << 8 | (uint32_t) (b * 255.0 + 0.5);
+  }
+
+  free(stops);
+
+  cairo_surface_t *ptr = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, heatmap->width, heatmap->height);
+  assert(cairo_surface_status(ptr) == CAIRO_STATUS_SUCCESS);
+  cairo_surface_flush(ptr);
+
+  struct HeatmapColorizeJob job;
+  job.heatmap = heatmap;
+  job.ramp = ramp;
+  job.scale = max > 0.0 ? (AG_HEATMAP_RAMP_SIZE - 1) / max : 0.0;
+  job.data = cairo_image_surface_get_data(ptr);
+  job.stride = cairo_image_surface_get_stride(ptr);
+  agParallelFor((size_t) heatmap->height, AG_PARALLEL_GRAIN, agHeatmapColorizeRows, &job);
+
+  cairo_surface_mark_dirty(ptr);
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  agSurfaceSetNew(vm, result_slot, ptr);
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+static void agHeatmapSizeGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_HEATMAP_TAG);
+  struct Heatmap *heatmap = agateSlotGetForeign(vm, 0);
+
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Vector2", class_slot);
+
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Vector2 *result = agateSlotSetForeign(vm, result_slot, class_slot);
+  result->x = heatmap->width;
+  result->y = heatmap->height;
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
+}
+
+/*
+ * Font
+ */
+
+struct FontFaceEntry {
+  char *family;
+  cairo_font_slant_t slant;
+  cairo_font_weight_t weight;
+  cairo_font_face_t *face;
+};
+
+// process-wide, font faces are never evicted
+static struct {
+  struct FontFaceEntry *entries;
+  size_t count;
+  size_t capacity;
+} g_font_faces = { NULL, 0, 0 };
+
+static cairo_font_face_t *agFontFaceLookup(const char *family, cairo_font_slant_t slant, cairo_font_weight_t weight) {
+  for (size_t i = 0; i < g_font_faces.count; ++i) {
+    struct FontFaceEntry *entry = &g_font_faces.entries[i];
+
+    if (entry->slant == slant && entry->weight == weight && equals(entry->family, family)) {
+      return cairo_font_face_reference(entry->face);
+    }
+  }
+
+  if (g_font_faces.count == g_font_faces.capacity) {
+    g_font_faces.capacity = g_font_faces.capacity == 0 ? 8 : 2 * g_font_faces.capacity;
+    g_font_faces.entries = realloc(g_font_faces.entries, g_font_faces.capacity * sizeof(struct FontFaceEntry));
+    assert(g_font_faces.entries);
+  }
+
+  struct FontFaceEntry *entry = &g_font_faces.entries[g_font_faces.count++];
+  size_t length = strlen(family);
+  entry->family = malloc(length + 1);
+  assert(entry->family);
+  memcpy(entry->family, family, length + 1);
+  entry->slant = slant;
+  entry->weight = weight;
+  entry->face = cairo_toy_font_face_create(family, slant, weight);
+  return cairo_font_face_reference(entry->face);
+}
+
+static uintptr_t agFontFaceGeneration(cairo_font_face_t *face) {
+  uintptr_t generation = (uintptr_t) cairo_font_face_get_user_data(face, &g_generation_key);
+
+  if (generation == 0) {
+    generation = ++g_generation;
+    cairo_font_face_set_user_data(face, &g_generation_key, (void *) generation, NULL);
+  }
+
+  return generation;
+}
+
+// glyph indices and advances of ASCII characters, per scaled font
+
+struct GlyphCache {
+  cairo_scaled_font_t *font;
+  bool known[AG_GLYPH_CACHE_CHARS];
+  bool single[AG_GLYPH_CACHE_CHARS];
+  unsigned long index[AG_GLYPH_CACHE_CHARS];
+  double advance_x[AG_GLYPH_CACHE_CHARS];
+  double advance_y[AG_GLYPH_CACHE_CHARS];
+};
+
+static struct {
+  struct GlyphCache fonts[AG_GLYPH_CACHE_FONTS];
+  size_t next;
+} g_glyph_caches;
+
+static struct GlyphCache *agGlyphCacheLookup(cairo_scaled_font_t *font) {
+  for (size_t i = 0; i < AG_GLYPH_CACHE_FONTS; ++i) {
+    if (g_glyph_caches.fonts[i].font == font) {
+      return &g_glyph_caches.fonts[i];
+    }
+  }
+
+  // the reference keeps the pointer from being reused by another scaled font
+  struct GlyphCache *cache = &g_glyph_caches.fonts[g_glyph_caches.next];
+  g_glyph_caches.next = (g_glyph_caches.next + 1) % AG_GLYPH_CACHE_FONTS;
+
+  if (cache->font != NULL) {
+    cairo_scaled_font_destroy(cache->font);
+  }
+
+  memset(cache, 0, sizeof(struct GlyphCache));
+  cache->font = cairo_scaled_font_reference(font);
+  return cache;
+}
+
+static bool agGlyphCacheGet(struct GlyphCache *cache, char c) {
+  unsigned char u = (unsigned char) c;
+
+  if (u >= AG_GLYPH_CACHE_CHARS) {
+    return false;
+  }
+
+  if (!cache->known[u]) {
+    cache->known[u] = true;
+
+    cairo_glyph_t *glyphs = NULL;
+    int glyph_count = 0;
+
+    if (cairo_scaled_font_text_to_glyphs(cache->font, 0.0, 0.0, &c, 1, &glyphs, &glyph_count, NULL, NULL, NULL) == CAIRO_STATUS_SUCCESS && glyph_count == 1) {
+      cairo_text_extents_t extents;
+      cairo_scaled_font_glyph_extents(cache->font, glyphs, 1, &extents);
+      cache->single[u] = true;
+      cache->index[u] = glyphs[0].index;
+      cache->advance_x[u] = extents.x_advance;
+      cache->advance_y[u] = extents.y_advance;
+    }
+
+    cairo_glyph_free(glyphs);
+  }
+
+  return cache->single[u];
+}
+
+struct Font {
+  cairo_font_face_t *ptr;
+};
+
+// class
+
+static ptrdiff_t agFontAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Font);
+}
+
+static uint64_t agFontTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_FONT_TAG;
+}
+
+void agFontDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Font *font = data;
+
+  if (font->ptr != NULL) {
+    cairo_font_face_destroy(font->ptr);
+  }
+
+  font->ptr = NULL;
+}
+
+// methods
+
+static void agFontNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_FONT_TAG);
+  struct Font *font = agateSlotGetForeign(vm, 0);
+  const char *family = agateSlotGetString(vm, 1);
+  int64_t slant = agateSlotGetInt(vm, 2);
+  int64_t weight = agateSlotGetInt(vm, 3);
+  font->ptr = agFontFaceLookup(family, (cairo_font_slant_t) slant, (cairo_font_weight_t) weight);
+}
+
+/*
+ * TextExtents
+ */
+
+// class
+
+static ptrdiff_t agTextExtentsAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(cairo_text_extents_t);
+}
+
+static uint64_t agTextExtentsTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_EXTENTS_TAG;
+}
+
+// methods
+
+static void agTextExtentsXBearingGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_EXTENTS_TAG);
+  cairo_text_extents_t *extents = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, extents->x_bearing);
+}
+
+static void agTextExtentsYBearingGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_EXTENTS_TAG);
+  cairo_text_extents_t *extents = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, extents->y_bearing);
+}
+
+static void agTextExtentsWidthGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_EXTENTS_TAG);
+  cairo_text_extents_t *extents = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, extents->width);
+}
+
+static void agTextExtentsHeightGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_EXTENTS_TAG);
+  cairo_text_extents_t *extents = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, extents->height);
+}
+
+static void agTextExtentsXAdvanceGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_EXTENTS_TAG);
+  cairo_text_extents_t *extents = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, extents->x_advance);
+}
+
+static void agTextExtentsYAdvanceGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_EXTENTS_TAG);
+  cairo_text_extents_t *extents = agateSlotGetForeign(vm, 0);
+  agateSlotSetFloat(vm, AGATE_RETURN_SLOT, extents->y_advance);
+}
+
+/*
+ * SpatialIndex
+ */
+
+enum ShapeKind {
+  AG_SHAPE_FILL,
+  AG_SHAPE_STROKE,
+};
+
+struct Shape {
+  int64_t tag;
+  enum ShapeKind kind;
+  // bounds in device space
+  double x1;
+  double y1;
+  double x2;
+  double y2;
+  // geometry in user space, with the matrix at the time of drawing
+  cairo_path_t *path;
+  cairo_matrix_t matrix;
+  cairo_fill_rule_t fill_rule;
+  double line_width;
+  cairo_line_cap_t line_cap;
+  cairo_line_join_t line_join;
+  double miter_limit;
+};
+
+// indices of the shapes that touch a cell, in drawing order
+struct SpatialCell {
+  size_t *shapes;
+  size_t count;
+  size_t capacity;
+};
+
+struct SpatialIndex {
+  struct Shape *shapes;
+  size_t shape_count;
+  size_t shape_capacity;
+  // uniform grid, shapes added since the last query are inserted in the cells before the next one
+  // the grid is laid out again when the number of shapes has doubled, shapes outside of it go to the border cells
+  size_t indexed_count;
+  size_t layout_count;
+  double x0;
+  double y0;
+  double cell_size;
+  ptrdiff_t columns;
+  ptrdiff_t rows;
+  struct SpatialCell *cells;
+  // scratch context for exact hit tests
+  cairo_surface_t *probe_surface;
+  cairo_t *probe;
+};
+
+static struct SpatialIndex *agSpatialIndexCreate(void) {
+  struct SpatialIndex *index = calloc(1, sizeof(struct SpatialIndex));
+  assert(index);
+  index->cell_size = AG_SPATIAL_INDEX_CELL_SIZE;
+  index->probe_surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+  index->probe = cairo_create(index->probe_surface);
+  return index;
+}
+
+static void agSpatialIndexDestroy(struct SpatialIndex *index) {
+  for (size_t i = 0; i < index->shape_count; ++i) {
+    cairo_path_destroy(index->shapes[i].path);
+  }
+
+  free(index->shapes);
+
+  for (ptrdiff_t cell = 0; cell < index->columns * index->rows; ++cell) {
+    free(index->cells[cell].shapes);
+  }
+
+  free(index->cells);
+  cairo_destroy(index->probe);
+  cairo_surface_destroy(index->probe_surface);
+  free(index);
+}
+
+static void agDeviceExtents(cairo_t *cr, double *x1, double *y1, double *x2, double *y2) {
+  double xs[4] = { *x1, *x2, *x1, *x2 };
+  double ys[4] = { *y1, *y1, *y2, *y2 };
+
+  for (int i = 0; i < 4; ++i) {
+    cairo_user_to_device(cr, &xs[i], &ys[i]);
+  }
+
+  *x1 = min2(min2(xs[0], xs[1]), min2(xs[2], xs[3]));
+  *y1 = min2(min2(ys[0], ys[1]), min2(ys[2], ys[3]));
+  *x2 = max2(max2(xs[0], xs[1]), max2(xs[2], xs[3]));
+  *y2 = max2(max2(ys[0], ys[1]), max2(ys[2], ys[3]));
+}
+
+static void agSpatialIndexAdd(struct SpatialIndex *index, cairo_t *cr, int64_t tag, enum ShapeKind kind) {
+  struct Shape shape;
+  shape.tag = tag;
+  shape.kind = kind;
+
+  if (kind == AG_SHAPE_FILL) {
+    cairo_fill_extents(cr, &shape.x1, &shape.y1, &shape.x2, &shape.y2);
+  } else {
+    cairo_stroke_extents(cr, &shape.x1, &shape.y1, &shape.x2, &shape.y2);
+  }
+
+  if (shape.x1 >= shape.x2 || shape.y1 >= shape.y2) {
+    return;
+  }
+
+  agDeviceExtents(cr, &shape.x1, &shape.y1, &shape.x2, &shape.y2);
+
+  if (!isfinite(shape.x1) || !isfinite(shape.y1) || !isfinite(shape.x2) || !isfinite(shape.y2)) {
+    return;
+  }
+
+  shape.path = cairo_copy_path(cr);
+  cairo_get_matrix(cr, &shape.matrix);
+  shape.fill_rule = cairo_get_fill_rule(cr);
+  shape.line_width = cairo_get_line_width(cr);
+  shape.line_cap = cairo_get_line_cap(cr);
+  shape.line_join = cairo_get_line_join(cr);
+  shape.miter_limit = cairo_get_miter_limit(cr);
+
+  if (index->shape_count == index->shape_capacity) {
+    index->shape_capacity = index->shape_capacity == 0 ? 64 : 2 * index->shape_capacity;
+    index->shapes = realloc(index->shapes, index->shape_capacity * sizeof(struct Shape));
+    assert(index->shapes);
+  }
+
+  index->shapes[index->shape_count++] = shape;
+}
+
+// clamped before the conversion, NaN goes to the first cell
+static inline ptrdiff_t agSpatialIndexColumn(const struct SpatialIndex *index, double x) {
+  double column = floor((x - index->x0) / index->cell_size);
+  return !(column > 0.0) ? 0 : (column >= (double) index->columns ? index->columns - 1 : (ptrdiff_t) column);
+}
+
+static inline ptrdiff_t agSpatialIndexRow(const struct SpatialIndex *index, double y) {
+  double row = floor((y - index->y0) / index->cell_size);
+  return !(row > 0.0) ? 0 : (row >= (double) index->rows ? index->rows - 1 : (ptrdiff_t) row);
+}
+
+static void agSpatialIndexLayout(struct SpatialIndex *index) {
+  assert(index->shape_count > 0);
+
+  double x1 = index->shapes[0].x1;
+  double y1 = index->shapes[0].y1;
+  double x2 = index->shapes[0].x2;
+  double y2 = index->shapes[0].y2;
+
+  for (size_t i = 1; i < index->shape_count; ++i) {
+    x1 = min2(x1, index->shapes[i].x1);
+    y1 = min2(y1, index->shapes[i].y1);
+    x2 = max2(x2, index->shapes[i].x2);
+    y2 = max2(y2, index->shapes[i].y2);
+  }
+
+  for (ptrdiff_t cell = 0; cell < index->columns * index->rows; ++cell) {
+    free(index->cells[cell].shapes);
+  }
+
+  free(index->cells);
+
+  index->x0 = x1;
+  index->y0 = y1;
+  index->cell_size = AG_SPATIAL_INDEX_CELL_SIZE;
+
+  // the bounds are finite but their difference may not be, the grid is clamped in any case
+  double columns = ceil((x2 - x1) / index->cell_size) + 1.0;
+  double rows = ceil((y2 - y1) / index->cell_size) + 1.0;
+
+  while (!(columns * rows <= AG_SPATIAL_INDEX_MAX_CELLS) && index->cell_size < DBL_MAX / 4.0) {
+    index->cell_size *= 2.0;
+    columns = ceil((x2 - x1) / index->cell_size) + 1.0;
+    rows = ceil((y2 - y1) / index->cell_size) + 1.0;
+  }
+
+  if (columns * rows <= AG_SPATIAL_INDEX_MAX_CELLS) {
+    index->columns = (ptrdiff_t) columns;
+    index->rows = (ptrdiff_t) rows;
+  } else {
+    index->columns = index->rows = (ptrdiff_t) sqrt(AG_SPATIAL_INDEX_MAX_CELLS);
+  }
+
+  index->cells = calloc((size_t) (index->columns * index->rows), sizeof(struct SpatialCell));
+  assert(index->cells);
+  index->indexed_count = 0;
+  index->layout_count = index->shape_count;
+}
+
+static void agSpatialIndexUpdate(struct SpatialIndex *index) {
+  if (index->cells == NULL || index->shape_count >= 2 * index->layout_count) {
+    agSpatialIndexLayout(index);
+  }
+
+  for (size_t i = index->indexed_count; i < index->shape_count; ++i) {
+    const struct Shape *shape = &index->shapes[i];
+    ptrdiff_t column_min = agSpatialIndexColumn(index, shape->x1);
+    ptrdiff_t column_max = agSpatialIndexColumn(index, shape->x2);
+    ptrdiff_t row_min = agSpatialIndexRow(index, shape->y1);
+    ptrdiff_t row_max = agSpatialIndexRow(index, shape->y2);
+
+    for (ptrdiff_t row = row_min; row <= row_max; ++row) {
+      for (ptrdiff_t column = column_min; column <= column_max; ++column) {
+        struct SpatialCell *cell = &index->cells[row * index->columns + column];
+
+        if (cell->count == cell->capacity) {
+          cell->capacity = cell->capacity == 0 ? 8 : 2 * cell->capacity;
+          cell->shapes = realloc(cell->shapes, cell->capacity * sizeof(size_t));
+          assert(cell->shapes);
+        }
+
+        cell->shapes[cell->count++] = i;
+      }
+    }
+  }
+
+  index->indexed_count = index->shape_count;
+}
+
+static bool agSpatialIndexContains(struct SpatialIndex *index, const struct Shape *shape, double x, double y) {
+  if (x < shape->x1 || x > shape->x2 || y < shape->y1 || y > shape->y2) {
+    return false;
+  }
+
+  cairo_t *probe = index->probe;
+  cairo_new_path(probe);
+  cairo_set_matrix(probe, &shape->matrix);
+  cairo_append_path(probe, shape->path);
+  cairo_device_to_user(probe, &x, &y);
+
+  if (shape->kind == AG_SHAPE_FILL) {
+    cairo_set_fill_rule(probe, shape->fill_rule);
+    return cairo_in_fill(probe, x, y);
+  }
+
+  cairo_set_line_width(probe, shape->line_width);
+  cairo_set_line_cap(probe, shape->line_cap);
+  cairo_set_line_join(probe, shape->line_join);
+  cairo_set_miter_limit(probe, shape->miter_limit);
+  return cairo_in_stroke(probe, x, y);
+}
+
+static const struct Shape *agSpatialIndexHitTest(struct SpatialIndex *index, double x, double y) {
+  agSpatialIndexUpdate(index);
+
+  // clamped like the shapes, a point outside of the grid can only hit the shapes of the border cells
+  const struct SpatialCell *cell = &index->cells[agSpatialIndexRow(index, y) * index->columns + agSpatialIndexColumn(index, x)];
+
+  // the topmost shape is the last one drawn
+
+  for (size_t i = cell->count; i > 0; --i) {
+    const struct Shape *shape = &index->shapes[cell->shapes[i - 1]];
+
+    if (agSpatialIndexContains(index, shape, x, y)) {
+      return shape;
+    }
+  }
+
+  return NULL;
+}
+
+static int agCompareTags(const void *lhs, const void *rhs) {
+  int64_t a = *(const int64_t *) lhs;
+  int64_t b = *(const int64_t *) rhs;
+  return (a > b) - (a < b);
+}
+
+// returns the sorted, unique tags of the shapes whose bounds intersect the rectangle
+static size_t agSpatialIndexQuery(struct SpatialIndex *index, double x1, double y1, double x2, double y2, int64_t **tags) {
+  agSpatialIndexUpdate(index);
+
+  ptrdiff_t column_min = agSpatialIndexColumn(index, x1);
+  ptrdiff_t column_max = agSpatialIndexColumn(index, x2);
+  ptrdiff_t row_min = agSpatialIndexRow(index, y1);
+  ptrdiff_t row_max = agSpatialIndexRow(index, y2);
+
+  size_t capacity = 0;
+
+  for (ptrdiff_t row = row_min; row <= row_max; ++row) {
+    for (ptrdiff_t column = column_min; column <= column_max; ++column) {
+      capacity += index->cells[row * index->columns + column].count;
+    }
+  }
+
+  int64_t *result = malloc((capacity + 1) * sizeof(int64_t));
+  assert(result);
+  size_t count = 0;
+
+  for (ptrdiff_t row = row_min; row <= row_max; ++row) {
+    for (ptrdiff_t column = column_min; column <= column_max; ++column) {
+      const struct SpatialCell *cell = &index->cells[row * index->columns + column];
+
+      for (size_t i = 0; i < cell->count; ++i) {
+        const struct Shape *shape = &index->shapes[cell->shapes[i]];
+
+        if (shape->x2 >= x1 && shape->x1 <= x2 && shape->y2 >= y1 && shape->y1 <= y2) {
+          result[count++] = shape->tag;
+        }
+      }
+    }
+  }
+
+  qsort(result, count, sizeof(int64_t), agCompareTags);
+
+  size_t unique = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (unique == 0 || result[unique - 1] != result[i]) {
+      result[unique++] = result[i];
+    }
+  }
+
+  *tags = result;
+  return unique;
+}
+
+/*
+ * Damage
+ */
+
+// a drawing operation, identified by the hash of everything that affects its pixels
+struct DrawOp {
+  uint64_t hash;
+  // bounds in device space
+  double x1;
+  double y1;
+  double x2;
+  double y2;
+};
+
+struct DamageLog {
+  struct DrawOp *ops;
+  size_t count;
+  size_t capacity;
+};
+
+static void agDamageLogRelease(struct DamageLog *log) {
+  free(log->ops);
+  log->ops = NULL;
+  log->count = log->capacity = 0;
+}
+
+static void agDamageLogAppend(struct DamageLog *log, const struct DrawOp *op) {
+  if (log->count == log->capacity) {
+    log->capacity = log->capacity == 0 ? 256 : 2 * log->capacity;
+    log->ops = realloc(log->ops, log->capacity * sizeof(struct DrawOp));
+    assert(log->ops);
+  }
+
+  log->ops[log->count++] = *op;
+}
+
+static uint64_t agHashPattern(uint64_t hash, cairo_pattern_t *pattern) {
+  cairo_pattern_type_t type = cairo_pattern_get_type(pattern);
+  hash = agHashInt(hash, type);
+
+  cairo_matrix_t matrix;
+  cairo_pattern_get_matrix(pattern, &matrix);
+  hash = agHash(hash, &matrix, sizeof(matrix));
+  hash = agHashInt(hash, cairo_pattern_get_extend(pattern));
+
+  double values[6] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+  switch (type) {
+    case CAIRO_PATTERN_TYPE_SOLID:
+      cairo_pattern_get_rgba(pattern, &values[0], &values[1], &values[2], &values[3]);
+      return agHash(hash, values, 4 * sizeof(double));
+
+    case CAIRO_PATTERN_TYPE_SURFACE: {
+      // set_source_surface creates a new pattern each time, but the surface is the same
+      cairo_surface_t *surface = NULL;
+      cairo_pattern_get_surface(pattern, &surface);
+      hash = agHashInt(hash, (int64_t) agSurfaceGeneration(surface));
+      return agHashInt(hash, cairo_pattern_get_filter(pattern));
+    }
+
+    case CAIRO_PATTERN_TYPE_LINEAR:
+      cairo_pattern_get_linear_points(pattern, &values[0], &values[1], &values[2], &values[3]);
+      hash = agHash(hash, values, 4 * sizeof(double));
+      break;
+
+    case CAIRO_PATTERN_TYPE_RADIAL:
+      cairo_pattern_get_radial_circles(pattern, &values[0], &values[1], &values[2], &values[3], &values[4], &values[5]);
+      hash = agHash(hash, values, 6 * sizeof(double));
+      break;
+
+    default:
+      return agHash(hash, &pattern, sizeof(pattern));
+  }
+
+  int stop_count = 0;
+  cairo_pattern_get_color_stop_count(pattern, &stop_count);
+
+  for (int i = 0; i < stop_count; ++i) {
+    cairo_pattern_get_color_stop_rgba(pattern, i, &values[0], &values[1], &values[2], &values[3], &values[4]);
+    hash = agHash(hash, values, 5 * sizeof(double));
+  }
+
+  return hash;
+}
+
+static uint64_t agHashPath(uint64_t hash, cairo_t *cr) {
+  cairo_path_t *path = cairo_copy_path(cr);
+
+  for (int i = 0; i < path->num_data; i += path->data[i].header.length) {
+    const cairo_path_data_t *data = &path->data[i];
+    hash = agHashInt(hash, data->header.type);
+
+    for (int j = 1; j < data->header.length; ++j) {
+      hash = agHashDouble(hash, data[j].point.x);
+      hash = agHashDouble(hash, data[j].point.y);
+    }
+  }
+
+  cairo_path_destroy(path);
+  return hash;
+}
+
+static uint64_t g_unmatched_ops = 0;
+
+// the state common to every drawing operation
+static uint64_t agHashState(uint64_t hash, cairo_t *cr) {
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  hash = agHash(hash, &matrix, sizeof(matrix));
+  hash = agHashInt(hash, cairo_get_operator(cr));
+  hash = agHashInt(hash, cairo_get_antialias(cr));
+  hash = agHashDouble(hash, cairo_get_tolerance(cr));
+
+  cairo_rectangle_list_t *clip = cairo_copy_clip_rectangle_list(cr);
+
+  if (clip->status == CAIRO_STATUS_SUCCESS) {
+    hash = agHashInt(hash, clip->num_rectangles);
+    hash = agHash(hash, clip->rectangles, (size_t) clip->num_rectangles * sizeof(cairo_rectangle_t));
+  } else {
+    // a clip that is not made of rectangles can not be compared, the operation never matches
+    hash = agHashInt(hash, (int64_t) ++g_unmatched_ops);
+  }
+
+  cairo_rectangle_list_destroy(clip);
+
+  return agHashPattern(hash, cairo_get_source(cr));
+}
+
+/*
+ * Plot
+ */
+
+// data is decimated per device column: only the extreme values of a column can change its pixels
+
+struct PlotColumn {
+  bool active;
+  int64_t column;
+  size_t count;
+  struct Vector2 first;
+  struct Vector2 last;
+  struct Vector2 min;
+  struct Vector2 max;
+  size_t min_order;
+  size_t max_order;
+};
+
+// decimated points of a chunk of data, NaN marks a break in the line
+struct PlotPoints {
+  struct Vector2 *data;
+  size_t size;
+  size_t capacity;
+};
+
+static void agPlotPointsPush(struct PlotPoints *points, struct Vector2 p) {
+  if (points->size > 0) {
+    const struct Vector2 *last = &points->data[points->size - 1];
+
+    if ((last->x == p.x && last->y == p.y) || (isnan(last->x) && isnan(p.x))) {
+      return;
+    }
+  }
+
+  if (points->size == points->capacity) {
+    points->capacity = points->capacity == 0 ? 256 : 2 * points->capacity;
+    points->data = realloc(points->data, points->capacity * sizeof(struct Vector2));
+    assert(points->data);
+  }
+
+  points->data[points->size++] = p;
+}
+
+static void agPlotColumnFlush(struct PlotPoints *points, struct PlotColumn *column) {
+  if (!column->active) {
+    return;
+  }
+
+  agPlotPointsPush(points, column->first);
+
+  if (column->count > 2) {
+    // the extremes in the order they were reached
+    bool min_first = column->min_order < column->max_order;
+    agPlotPointsPush(points, min_first ? column->min : column->max);
+    agPlotPointsPush(points, min_first ? column->max : column->min);
+  }
+
+  agPlotPointsPush(points, column->last);
+  column->active = false;
+}
+
+// the device columns that can be visible, the columns outside of it are merged into one on each side
+// their points keep their coordinates, so the merged segments stay outside of the clip
+struct PlotRange {
+  double left;
+  double right;
+};
+
+// called with the identity matrix, ctm is the matrix of the user space
+static void agPlotRangeInit(struct PlotRange *range, cairo_t *cr, const cairo_matrix_t *ctm) {
+  double y1, y2;
+  cairo_clip_extents(cr, &range->left, &y1, &range->right, &y2);
+
+  // a stroke reaches the clip from further away, miter joins included
+  double reach = 0.5 * cairo_get_line_width(cr) * max2(cairo_get_miter_limit(cr), 1.0);
+  double margin = reach * (hypot(ctm->xx, ctm->yx) + hypot(ctm->xy, ctm->yy)) + 1.0;
+
+  // also keeps the columns in the range of int64_t
+  range->left = max2(floor(range->left - margin), -AG_PLOT_MAX_COLUMN);
+  range->right = min2(ceil(range->right + margin), AG_PLOT_MAX_COLUMN);
+
+  if (!(range->left <= range->right)) {
+    range->left = -AG_PLOT_MAX_COLUMN;
+    range->right = AG_PLOT_MAX_COLUMN;
+  }
+}
+
+static int64_t agPlotRangeColumn(const struct PlotRange *range, double x) {
+  if (x < range->left) {
+    return (int64_t) range->left - 1;
+  }
+
+  if (x > range->right) {
+    return (int64_t) range->right + 1;
+  }
+
+  return (int64_t) floor(x);
+}
+
+struct PlotLinesJob {
+  const cairo_matrix_t *matrix;
+  const struct PlotRange *range;
+  const double *xs;
+  const double *ys;
+  size_t count;
+  struct PlotPoints *chunks;
+};
+
+static void agPlotLinesChunks(void *data, size_t begin, size_t end) {
+  struct PlotLinesJob *job = data;
+  const cairo_matrix_t *matrix = job->matrix;
+
+  for (size_t chunk = begin; chunk < end; ++chunk) {
+    struct PlotPoints *points = &job->chunks[chunk];
+    struct PlotColumn column = { .active = false };
+    size_t last = (chunk + 1) * AG_PLOT_CHUNK < job->count ? (chunk + 1) * AG_PLOT_CHUNK : job->count;
+
+    for (size_t i = chunk * AG_PLOT_CHUNK; i < last; ++i) {
+      struct Vector2 p = {
+        matrix->xx * job->xs[i] + matrix->xy * job->ys[i] + matrix->x0,
+        matrix->yx * job->xs[i] + matrix->yy * job->ys[i] + matrix->y0,
+      };
+
+      if (!isfinite(p.x) || !isfinite(p.y)) {
+        // a missing value breaks the line
+        struct Vector2 gap = { NAN, NAN };
+        agPlotColumnFlush(points, &column);
+        agPlotPointsPush(points, gap);
+        continue;
+      }
+
+      int64_t index = agPlotRangeColumn(job->range, p.x);
+
+      if (column.active && column.column == index) {
+        column.last = p;
+
+        // ties keep the first extreme
+        if (p.y < column.min.y) {
+          column.min = p;
+          column.min_order = column.count;
+        }
+
+        if (p.y > column.max.y) {
+          column.max = p;
+          column.max_order = column.count;
+        }
+
+        ++column.count;
+        continue;
+      }
+
+      agPlotColumnFlush(points, &column);
+      column.active = true;
+      column.column = index;
+      column.count = 1;
+      column.first = column.last = column.min = column.max = p;
+      column.min_order = column.max_order = 0;
+    }
+
+    agPlotColumnFlush(points, &column);
+  }
+}
+
+// xs and ys are transformed by the matrix then appended in device space
+static void agPlotLines(cairo_t *cr, const cairo_matrix_t *matrix, const struct PlotRange *range, const double *xs, const double *ys, size_t count) {
+  // chunks are decimated in parallel, a column split between two chunks only costs a few points
+  size_t chunk_count = (count + AG_PLOT_CHUNK - 1) / AG_PLOT_CHUNK;
+  struct PlotLinesJob job = { matrix, range, xs, ys, count, calloc(chunk_count, sizeof(struct PlotPoints)) };
+  assert(job.chunks || chunk_count == 0);
+  agParallelFor(chunk_count, 1, agPlotLinesChunks, &job);
+
+  bool down = false;
+  struct Vector2 last = { 0.0, 0.0 };
+
+  for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+    struct PlotPoints *points = &job.chunks[chunk];
+
+    for (size_t i = 0; i < points->size; ++i) {
+      struct Vector2 p = points->data[i];
+
+      if (isnan(p.x)) {
+        down = false;
+      } else if (!down) {
+        cairo_move_to(cr, p.x, p.y);
+        down = true;
+      } else if (p.x != last.x || p.y != last.y) {
+        cairo_line_to(cr, p.x, p.y);
+      }
+
+      last = p;
+    }
+
+    free(points->data);
+  }
+
+  free(job.chunks);
+}
+
+// the tallest bar of the column, as wide as the bars together: the union of the bars would cover the gaps between them
+struct PlotBarColumn {
+  bool active;
+  int64_t column;
+  double x1, y1, x2, y2;
+  double width;
+};
+
+static void agPlotBarColumnFlush(cairo_t *cr, struct PlotBarColumn *column) {
+  if (column->active) {
+    double width = min2(column->width, column->x2 - column->x1);
+    double center = 0.5 * (column->x1 + column->x2);
+    cairo_rectangle(cr, center - 0.5 * width, column->y1, width, column->y2 - column->y1);
+    column->active = false;
+  }
+}
+
+// bars go from 0 to heights[i], centered on xs[i]
+static void agPlotBars(cairo_t *cr, const cairo_matrix_t *matrix, const struct PlotRange *range, const double *xs, const double *heights, size_t count, double width) {
+  if (matrix->xy != 0.0 || matrix->yx != 0.0) {
+    // rotated or skewed bars are not rectangles in device space, no decimation
+    for (size_t i = 0; i < count; ++i) {
+      double corners[4][2] = {
+        { xs[i] - 0.5 * width, 0.0 },
+        { xs[i] + 0.5 * width, 0.0 },
+        { xs[i] + 0.5 * width, heights[i] },
+        { xs[i] - 0.5 * width, heights[i] },
+      };
+
+      bool finite = true;
+
+      for (int j = 0; j < 4; ++j) {
+        cairo_matrix_transform_point(matrix, &corners[j][0], &corners[j][1]);
+        finite = finite && isfinite(corners[j][0]) && isfinite(corners[j][1]);
+      }
+
+      // like the axis-aligned bars, a NaN would put the context in an error state
+      if (!finite) {
+        continue;
+      }
+
+      cairo_move_to(cr, corners[0][0], corners[0][1]);
+      cairo_line_to(cr, corners[1][0], corners[1][1]);
+      cairo_line_to(cr, corners[2][0], corners[2][1]);
+      cairo_line_to(cr, corners[3][0], corners[3][1]);
+      cairo_close_path(cr);
+    }
+
+    return;
+  }
+
+  struct PlotBarColumn column = { .active = false };
+
+  for (size_t i = 0; i < count; ++i) {
+    double x1 = xs[i] - 0.5 * width;
+    double y1 = 0.0;
+    double x2 = xs[i] + 0.5 * width;
+    double y2 = heights[i];
+    cairo_matrix_transform_point(matrix, &x1, &y1);
+    cairo_matrix_transform_point(matrix, &x2, &y2);
+
+    if (!isfinite(x1) || !isfinite(x2) || !isfinite(y1) || !isfinite(y2)) {
+      continue;
+    }
+
+    double left = min2(x1, x2);
+    double right = max2(x1, x2);
+    double top = min2(y1, y2);
+    double bottom = max2(y1, y2);
+
+    if (right - left >= 1.0) {
+      agPlotBarColumnFlush(cr, &column);
+      cairo_rectangle(cr, left, top, right - left, bottom - top);
+      continue;
+    }
+
+    // thinner than a pixel: merged with the other bars of the column
+    int64_t index = agPlotRangeColumn(range, 0.5 * (left + right));
+
+    if (column.active && column.column == index) {
+      column.x1 = min2(column.x1, left);
+      column.y1 = min2(column.y1, top);
+      column.x2 = max2(column.x2, right);
+      column.y2 = max2(column.y2, bottom);
+      column.width += right - left;
+      continue;
+    }
+
+    agPlotBarColumnFlush(cr, &column);
+    column.active = true;
+    column.column = index;
+    column.x1 = left;
+    column.y1 = top;
+    column.x2 = right;
+    column.y2 = bottom;
+    column.width = right - left;
+  }
+
+  agPlotBarColumnFlush(cr, &column);
+}
+
+/*
+ * Context
+ */
+
+enum DrawOpKind {
+  AG_DRAW_FILL,
+  AG_DRAW_STROKE,
+  AG_DRAW_PAINT, // also used for operations whose ink extents are given by the caller
+};
+
+// shadow of the cairo state, to skip the calls that would not change anything
+
+enum ContextStateBit {
+  AG_STATE_SOURCE = 0x01,
+  AG_STATE_OPERATOR = 0x02,
+  AG_STATE_ANTIALIAS = 0x04,
+  AG_STATE_FILL_RULE = 0x08,
+  AG_STATE_LINE_CAP = 0x10,
+  AG_STATE_LINE_JOIN = 0x20,
+  AG_STATE_LINE_WIDTH = 0x40,
+  AG_STATE_MITER_LIMIT = 0x80,
+  AG_STATE_FONT_FACE = 0x100,
+  AG_STATE_FONT_SIZE = 0x200,
+};
+
+struct ContextState {
+  unsigned valid;
+  struct Color color;
+  int64_t op;
+  int64_t antialias;
+  int64_t fill_rule;
+  int64_t line_cap;
+  int64_t line_join;
+  double line_width;
+  double miter_limit;
+  cairo_font_face_t *font_face;
+  double font_size;
+};
+
+struct SolidPattern {
+  struct Color color;
+  cairo_pattern_t *pattern;
+};
+
+struct Context {
+  cairo_t *ptr;
+  bool tagged;
+  int64_t tag;
+  struct SpatialIndex *index;
+  struct DamageLog *damage;
+  struct ContextState state;
+  struct ContextState *saved;
+  size_t saved_count;
+  size_t saved_capacity;
+  struct SolidPattern solids[AG_SOLID_CACHE_SIZE];
+  int64_t skipped_calls;
+};
+
+static void agContextStatePush(struct Context *context) {
+  if (context->saved_count == context->saved_capacity) {
+    context->saved_capacity = context->saved_capacity == 0 ? 8 : 2 * context->saved_capacity;
+    context->saved = realloc(context->saved, context->saved_capacity * sizeof(struct ContextState));
+    assert(context->saved);
+  }
+
+  context->saved[context->saved_count++] = context->state;
+}
+
+static void agContextStatePop(struct Context *context) {
+  if (context->saved_count == 0) {
+    // unbalanced restore, cairo is in an error state and nothing is known anymore
+    context->state.valid = 0;
+    return;
+  }
+
+  context->state = context->saved[--context->saved_count];
+}
+
+static bool agContextStateSetInt(struct Context *context, enum ContextStateBit bit, int64_t *cached, int64_t value) {
+  if ((context->state.valid & bit) && *cached == value) {
+    ++context->skipped_calls;
+    return false;
+  }
+
+  context->state.valid |= bit;
+  *cached = value;
+  return true;
+}
+
+static bool agContextStateSetFloat(struct Context *context, enum ContextStateBit bit, double *cached, double value) {
+  if ((context->state.valid & bit) && *cached == value) {
+    ++context->skipped_calls;
+    return false;
+  }
+
+  context->state.valid |= bit;
+  *cached = value;
+  return true;
+}
+
+static bool agColorEquals(const struct Color *lhs, const struct Color *rhs) {
+  return lhs->r == rhs->r && lhs->g == rhs->g && lhs->b == rhs->b && lhs->a == rhs->a;
+}
+
+static cairo_pattern_t *agContextSolidPattern(struct Context *context, const struct Color *color) {
+  uint64_t hash = agHash(AG_HASH_SEED, color, sizeof(struct Color));
+  struct SolidPattern *solid = &context->solids[hash % AG_SOLID_CACHE_SIZE];
+
+  if (solid->pattern != NULL && agColorEquals(&solid->color, color)) {
+    return solid->pattern;
+  }
+
+  if (solid->pattern != NULL) {
+    cairo_pattern_destroy(solid->pattern);
+  }
+
+  solid->color = *color;
+  solid->pattern = cairo_pattern_create_rgba(color->r, color->g, color->b, color->a);
+  return solid->pattern;
+}
+
+// these operators change the destination outside of the shape too
+static bool agOperatorIsUnbounded(cairo_operator_t op) {
+  return op == CAIRO_OPERATOR_IN || op == CAIRO_OPERATOR_OUT || op == CAIRO_OPERATOR_DEST_IN || op == CAIRO_OPERATOR_DEST_ATOP;
+}
+
+// called before each drawing operation, hash is the seed for the arguments that are not in the cairo state
+// ink is the device space bounds of a paint operation, the whole clip if NULL
+static void agContextRecordInk(struct Context *context, enum DrawOpKind kind, uint64_t hash, const double *ink) {
+  agSurfaceTouch(cairo_get_target(context->ptr));
+
+  if (context->damage == NULL) {
+    return;
+  }
+
+  cairo_t *cr = context->ptr;
+  struct DrawOp op;
+
+  hash = agHashInt(hash, kind);
+  hash = agHashState(hash, cr);
+
+  cairo_clip_extents(cr, &op.x1, &op.y1, &op.x2, &op.y2);
+  agDeviceExtents(cr, &op.x1, &op.y1, &op.x2, &op.y2);
+
+  double x1 = 0.0, y1 = 0.0, x2 = 0.0, y2 = 0.0;
+  bool bounded = false;
+
+  if (kind == AG_DRAW_FILL || kind == AG_DRAW_STROKE) {
+    hash = agHashPath(hash, cr);
+
+    if (kind == AG_DRAW_FILL) {
+      hash = agHashInt(hash, cairo_get_fill_rule(cr));
+      cairo_fill_extents(cr, &x1, &y1, &x2, &y2);
+    } else {
+      hash = agHashDouble(hash, cairo_get_line_width(cr));
+      hash = agHashInt(hash, cairo_get_line_cap(cr));
+      hash = agHashInt(hash, cairo_get_line_join(cr));
+      hash = agHashDouble(hash, cairo_get_miter_limit(cr));
+      cairo_stroke_extents(cr, &x1, &y1, &x2, &y2);
+    }
+
+    agDeviceExtents(cr, &x1, &y1, &x2, &y2);
+    bounded = true;
+  } else if (ink != NULL) {
+    x1 = ink[0];
+    y1 = ink[1];
+    x2 = ink[2];
+    y2 = ink[3];
+    bounded = true;
+  }
+
+  if (bounded && !agOperatorIsUnbounded(cairo_get_operator(cr))) {
+    // one more pixel for antialiasing
+    op.x1 = max2(op.x1, floor(x1) - 1.0);
+    op.y1 = max2(op.y1, floor(y1) - 1.0);
+    op.x2 = min2(op.x2, ceil(x2) + 1.0);
+    op.y2 = min2(op.y2, ceil(y2) + 1.0);
+  }
+
+  op.hash = hash;
+
+  if (op.x1 < op.x2 && op.y1 < op.y2) {
+    agDamageLogAppend(context->damage, &op);
+  }
+}
+
+static void agContextRecordOp(struct Context *context, enum DrawOpKind kind, uint64_t hash) {
+  agContextRecordInk(context, kind, hash, NULL);
+}
+
+// class
+
+static ptrdiff_t agContextAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Context);
+}
+
+static uint64_t agContextTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_CONTEXT_TAG;
+}
+
+void agContextDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Context *context = data;
+
+  if (context->ptr != NULL) {
+    cairo_destroy(context->ptr);
+  }
+
+  if (context->index != NULL) {
+    agSpatialIndexDestroy(context->index);
+  }
+
+  if (context->damage != NULL) {
+    agDamageLogRelease(context->damage);
+    free(context->damage);
+  }
+
+  for (size_t i = 0; i < AG_SOLID_CACHE_SIZE; ++i) {
+    if (context->solids[i].pattern != NULL) {
+      cairo_pattern_destroy(context->solids[i].pattern);
+      context->solids[i].pattern = NULL;
+    }
+  }
+
+  free(context->saved);
+
+  context->ptr = NULL;
+  context->index = NULL;
+  context->damage = NULL;
+  context->saved = NULL;
+  context->saved_count = context->saved_capacity = 0;
+}
+
+// methods
+
+static void agContextNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 1);
+  agSurfaceMakeWritable(surface);
+  context->ptr = cairo_create(surface->ptr);
+  context->tagged = false;
+  context->tag = 0;
+  context->index = NULL;
+  context->damage = NULL;
+  context->state.valid = 0; // the first call of each setter always goes to cairo
+  context->saved = NULL;
+  context->saved_count = context->saved_capacity = 0;
+  memset(context->solids, 0, sizeof(context->solids));
+  context->skipped_calls = 0;
+}
+
+static void agContextSave(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  agContextStatePush(context);
+  cairo_save(context->ptr);
+}
+
+static void agContextRestore(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  agContextStatePop(context);
+  cairo_restore(context->ptr);
+}
+
+// group
+
+static void agContextPushGroup(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  agContextStatePush(context); // push_group saves the state
+  cairo_push_group(context->ptr);
+}
+
+static void agContextPopGroupToSource(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  agContextStatePop(context);
+  context->state.valid &= ~AG_STATE_SOURCE;
+  cairo_pop_group_to_source(context->ptr);
+}
+
+// matrix
+
+static void agContextTranslate(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double tx = agateSlotGetFloat(vm, 1);
+  double ty = agateSlotGetFloat(vm, 2);
+  cairo_translate(context->ptr, tx, ty);
+}
+
+static void agContextScale(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double sx = agateSlotGetFloat(vm, 1);
+  double sy = agateSlotGetFloat(vm, 2);
+  cairo_scale(context->ptr, sx, sy);
+}
+
+static void agContextRotate(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double angle = agateSlotGetFloat(vm, 1);
+  cairo_rotate(context->ptr, angle);
+}
+
+// source
+
+static void agContextSetSourceColor(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_COLOR_TAG);
+  struct Color *color = agateSlotGetForeign(vm, 1);
+
+  if ((context->state.valid & AG_STATE_SOURCE) && agColorEquals(&context->state.color, color)) {
+    ++context->skipped_calls;
+    return;
+  }
+
+  context->state.valid |= AG_STATE_SOURCE;
+  context->state.color = *color;
+  cairo_set_source(context->ptr, agContextSolidPattern(context, color));
+}
+
+static void agContextSetSourceSurface(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 1);
+  double x = agateSlotGetFloat(vm, 2);
+  double y = agateSlotGetFloat(vm, 3);
+  context->state.valid &= ~AG_STATE_SOURCE;
+  cairo_set_source_surface(context->ptr, surface->ptr, x, y);
+}
+
+static void agContextSetSourcePattern(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_PATTERN_TAG);
+  struct Pattern *pattern = agateSlotGetForeign(vm, 1);
+  context->state.valid &= ~AG_STATE_SOURCE; // the pattern may have been modified since
+  cairo_set_source(context->ptr, pattern->ptr);
+}
+
+// style
+
+static void agContextSetAntialias(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+
+  if (agContextStateSetInt(context, AG_STATE_ANTIALIAS, &context->state.antialias, raw)) {
+    cairo_set_antialias(context->ptr, (cairo_antialias_t) raw);
+  }
+}
+
+static void agContextSetFillRule(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+
+  if (agContextStateSetInt(context, AG_STATE_FILL_RULE, &context->state.fill_rule, raw)) {
+    cairo_set_fill_rule(context->ptr, (cairo_fill_rule_t) raw);
+  }
+}
+
+static void agContextSetLineCap(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+
+  if (agContextStateSetInt(context, AG_STATE_LINE_CAP, &context->state.line_cap, raw)) {
+    cairo_set_line_cap(context->ptr, (cairo_line_cap_t) raw);
+  }
+}
+
+static void agContextSetLineJoin(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+
+  if (agContextStateSetInt(context, AG_STATE_LINE_JOIN, &context->state.line_join, raw)) {
+    cairo_set_line_join(context->ptr, (cairo_line_join_t) raw);
+  }
+}
+
+static void agContextSetLineWidth(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double width = agateSlotGetFloat(vm, 1);
+
+  if (agContextStateSetFloat(context, AG_STATE_LINE_WIDTH, &context->state.line_width, width)) {
+    cairo_set_line_width(context->ptr, width);
+  }
+}
+
+static void agContextSetMiterLimit(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double limit = agateSlotGetFloat(vm, 1);
+
+  if (agContextStateSetFloat(context, AG_STATE_MITER_LIMIT, &context->state.miter_limit, limit)) {
+    cairo_set_miter_limit(context->ptr, limit);
+  }
+}
+
+static void agContextSetOperator(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  int64_t raw = agateSlotGetInt(vm, 1);
+
+  if (agContextStateSetInt(context, AG_STATE_OPERATOR, &context->state.op, raw)) {
+    cairo_set_operator(context->ptr, (cairo_operator_t) raw);
+  }
+}
+
+// draw
+
+static void agContextClip(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  bool preserve = agateSlotGetBool(vm, 1);
+
+  if (preserve) {
+    cairo_clip_preserve(context->ptr);
+  } else {
+    cairo_clip(context->ptr);
+  }
+}
+
+static void agContextIndexShape(struct Context *context, enum ShapeKind kind) {
+  if (!context->tagged) {
+    return;
+  }
+
+  if (context->index == NULL) {
+    context->index = agSpatialIndexCreate();
+  }
+
+  agSpatialIndexAdd(context->index, context->ptr, context->tag, kind);
+}
+
+static void agContextFill(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  bool preserve = agateSlotGetBool(vm, 1);
+  agContextIndexShape(context, AG_SHAPE_FILL);
+  agContextRecordOp(context, AG_DRAW_FILL, AG_HASH_SEED);
+
+  if (preserve) {
+    cairo_fill_preserve(context->ptr);
+  } else {
+    cairo_fill(context->ptr);
+  }
+}
+
+static void agContextStroke(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  bool preserve = agateSlotGetBool(vm, 1);
+  agContextIndexShape(context, AG_SHAPE_STROKE);
+  agContextRecordOp(context, AG_DRAW_STROKE, AG_HASH_SEED);
+
+  if (preserve) {
+    cairo_stroke_preserve(context->ptr);
+  } else {
+    cairo_stroke(context->ptr);
+  }
+}
+
+static void agContextPaint(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  agContextRecordOp(context, AG_DRAW_PAINT, AG_HASH_SEED);
+  cairo_paint(context->ptr);
+}
+
+static void agContextPaintWithAlpha(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double alpha = agateSlotGetFloat(vm, 1);
+  agContextRecordOp(context, AG_DRAW_PAINT, agHashDouble(AG_HASH_SEED, alpha));
+  cairo_paint_with_alpha(context->ptr, alpha);
+}
+
+// path
+
+static void agContextMoveTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double x = agateSlotGetFloat(vm, 1);
+  double y = agateSlotGetFloat(vm, 2);
+  cairo_move_to(context->ptr, x, y);
+}
+
+static void agContextLineTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double x = agateSlotGetFloat(vm, 1);
+  double y = agateSlotGetFloat(vm, 2);
+  cairo_line_to(context->ptr, x, y);
+}
+
+static void agContextCurveTo(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double x1 = agateSlotGetFloat(vm, 1);
+  double y1 = agateSlotGetFloat(vm, 2);
+  double x2 = agateSlotGetFloat(vm, 3);
+  double y2 = agateSlotGetFloat(vm, 4);
+  double x3 = agateSlotGetFloat(vm, 5);
+  double y3 = agateSlotGetFloat(vm, 6);
+  cairo_curve_to(context->ptr, x1, y1, x2, y2, x3, y3);
+}
+
+static void agContextClosePath(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  cairo_close_path(context->ptr);
+}
+
+static void agContextRectangle(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double x = agateSlotGetFloat(vm, 1);
+  double y = agateSlotGetFloat(vm, 2);
+  double width = agateSlotGetFloat(vm, 3);
+  double height = agateSlotGetFloat(vm, 4);
+  cairo_rectangle(context->ptr, x, y, width, height);
+}
+
+static void agContextArc(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double xc = agateSlotGetFloat(vm, 1);
+  double yc = agateSlotGetFloat(vm, 2);
+  double radius = agateSlotGetFloat(vm, 3);
+  double angle1 = agateSlotGetFloat(vm, 4);
+  double angle2 = agateSlotGetFloat(vm, 5);
+  cairo_arc(context->ptr, xc, yc, radius, angle1, angle2);
+}
+
+static void agContextArcNegative(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double xc = agateSlotGetFloat(vm, 1);
+  double yc = agateSlotGetFloat(vm, 2);
+  double radius = agateSlotGetFloat(vm, 3);
+  double angle1 = agateSlotGetFloat(vm, 4);
+  double angle2 = agateSlotGetFloat(vm, 5);
+  cairo_arc_negative(context->ptr, xc, yc, radius, angle1, angle2);
+}
+
+// sprites
+
+// the sprite is centered on its position, in the user space
+static void agSpriteMatrix(const double *instance, const struct Sprite *sprite, cairo_matrix_t *matrix) {
+  double scale = instance[3];
+  cairo_matrix_init_translate(matrix, instance[1], instance[2]);
+  cairo_matrix_rotate(matrix, instance[4]);
+  cairo_matrix_scale(matrix, scale, scale);
+  cairo_matrix_translate(matrix, -0.5 * sprite->width, -0.5 * sprite->height);
+}
+
+static bool agSpriteInstanceIsValid(const double *instance, const struct SpriteAtlas *atlas) {
+  double id = instance[0];
+  return id >= 0 && id < (double) atlas->count;
+}
+
+static void agContextDrawSprites(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_ATLAS_TAG);
+  struct SpriteAtlas *atlas = agateSlotGetForeign(vm, 1);
+
+  struct FloatView instances;
+  agSlotGetFloatView(vm, 2, &instances);
+
+  cairo_t *cr = context->ptr;
+  uint64_t hash = AG_HASH_SEED;
+  double ink[4] = { INFINITY, INFINITY, -INFINITY, -INFINITY };
+
+  if (context->damage != NULL) {
+    hash = agHashInt(hash, (int64_t) agSurfaceGeneration(atlas->ptr));
+    hash = agHashInt(hash, (int64_t) atlas->count);
+    hash = agHash(hash, instances.data, instances.size * sizeof(double));
+
+    // union of the destination rectangles
+    for (size_t i = 0; i + AG_SPRITE_INSTANCE_SIZE <= instances.size; i += AG_SPRITE_INSTANCE_SIZE) {
+      const double *instance = instances.data + i;
+
+      if (!agSpriteInstanceIsValid(instance, atlas)) {
+        continue;
+      }
+
+      const struct Sprite *sprite = &atlas->sprites[(size_t) instance[0]];
+      cairo_matrix_t matrix;
+      agSpriteMatrix(instance, sprite, &matrix);
+
+      double corners[4][2] = {
+        { 0.0, 0.0 },
+        { sprite->width, 0.0 },
+        { sprite->width, sprite->height },
+        { 0.0, sprite->height },
+      };
+
+      for (int j = 0; j < 4; ++j) {
+        cairo_matrix_transform_point(&matrix, &corners[j][0], &corners[j][1]);
+        cairo_user_to_device(cr, &corners[j][0], &corners[j][1]);
+        ink[0] = min2(ink[0], corners[j][0]);
+        ink[1] = min2(ink[1], corners[j][1]);
+        ink[2] = max2(ink[2], corners[j][0]);
+        ink[3] = max2(ink[3], corners[j][1]);
+      }
+    }
+  }
+
+  agContextRecordInk(context, AG_DRAW_PAINT, hash, ink);
+
+  cairo_matrix_t ctm;
+  cairo_get_matrix(cr, &ctm);
+
+  cairo_pattern_t *pattern = cairo_pattern_create_for_surface(atlas->ptr);
+  cairo_save(cr);
+
+  for (size_t i = 0; i + AG_SPRITE_INSTANCE_SIZE <= instances.size; i += AG_SPRITE_INSTANCE_SIZE) {
+    const double *instance = instances.data + i;
+
+    if (!agSpriteInstanceIsValid(instance, atlas)) {
+      continue;
+    }
+
+    const struct Sprite *sprite = &atlas->sprites[(size_t) instance[0]];
+    double alpha = instance[5];
+
+    cairo_matrix_t local, matrix;
+    agSpriteMatrix(instance, sprite, &local);
+    cairo_matrix_multiply(&matrix, &local, &ctm);
+    cairo_set_matrix(cr, &matrix);
+
+    // the source is locked to the user space when it is set
+    cairo_matrix_t pattern_matrix;
+    cairo_matrix_init_translate(&pattern_matrix, sprite->x, sprite->y);
+    cairo_pattern_set_matrix(pattern, &pattern_matrix);
+    cairo_set_source(cr, pattern);
+
+    cairo_rectangle(cr, 0.0, 0.0, sprite->width, sprite->height);
+
+    if (alpha >= 1.0) {
+      cairo_fill(cr);
+    } else {
+      cairo_save(cr);
+      cairo_clip(cr);
+      cairo_paint_with_alpha(cr, alpha);
+      cairo_restore(cr);
+    }
+  }
+
+  cairo_restore(cr);
+  cairo_pattern_destroy(pattern);
+  agFloatViewRelease(&instances);
+}
+
+// text
+
+static void agContextSetFont(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_FONT_TAG);
+  struct Font *font = agateSlotGetForeign(vm, 1);
+
+  if ((context->state.valid & AG_STATE_FONT_FACE) && context->state.font_face == font->ptr) {
+    ++context->skipped_calls;
+    return;
+  }
+
+  context->state.valid |= AG_STATE_FONT_FACE;
+  context->state.font_face = font->ptr;
+  cairo_set_font_face(context->ptr, font->ptr);
+}
+
+static void agContextSetFontSize(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  double size = agateSlotGetFloat(vm, 1);
+
+  if (agContextStateSetFloat(context, AG_STATE_FONT_SIZE, &context->state.font_size, size)) {
+    cairo_set_font_size(context->ptr, size);
+  }
 }
 
-void agSurfaceDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
-  struct Surface *surface = data;
+static uint64_t agContextHashText(cairo_t *cr, const char *text) {
+  uint64_t hash = agHash(AG_HASH_SEED, text, strlen(text));
+  hash = agHashInt(hash, (int64_t) agFontFaceGeneration(cairo_get_font_face(cr)));
 
-  if (surface->ptr != NULL) {
-    cairo_surface_destroy(surface->ptr);
-  }
+  cairo_matrix_t font_matrix;
+  cairo_get_font_matrix(cr, &font_matrix);
+  hash = agHash(hash, &font_matrix, sizeof(font_matrix));
 
-  surface->ptr = NULL;
-}
+  double x = 0.0, y = 0.0;
 
-// methods
+  if (cairo_has_current_point(cr)) {
+    cairo_get_current_point(cr, &x, &y);
+  }
 
-static void agSurfaceNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
-  struct Surface *surface = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
-  struct Vector2 *size = agateSlotGetForeign(vm, 1);
-  surface->ptr = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size->x, size->y);
-  assert(surface->ptr);
+  hash = agHashDouble(hash, x);
+  return agHashDouble(hash, y);
 }
 
-static void agSurfaceNewFromPng(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
-  struct Surface *surface = agateSlotGetForeign(vm, 0);
-  const char *filename = agateSlotGetString(vm, 1);
-  surface->ptr = cairo_image_surface_create_from_png(filename);
-  assert(surface->ptr);
+// extents are relative to (x, y) in the user space
+static void agTextInk(cairo_t *cr, const cairo_text_extents_t *extents, double x, double y, double *ink) {
+  ink[0] = x + extents->x_bearing;
+  ink[1] = y + extents->y_bearing;
+  ink[2] = ink[0] + extents->width;
+  ink[3] = ink[1] + extents->height;
+  agDeviceExtents(cr, &ink[0], &ink[1], &ink[2], &ink[3]);
 }
 
-static void agSurfaceExport(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_SURFACE_TAG);
-  struct Surface *surface = agateSlotGetForeign(vm, 0);
-  const char *filename = agateSlotGetString(vm, 1);
-  cairo_status_t status = cairo_surface_write_to_png(surface->ptr, filename);
+static void agContextShowText(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  const char *text = agateSlotGetString(vm, 1);
 
-  if (status != CAIRO_STATUS_SUCCESS) {
-    fprintf(stderr, "Error: %s\n", cairo_status_to_string(status));
+  cairo_t *cr = context->ptr;
+  uint64_t hash = AG_HASH_SEED;
+  double ink[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+  if (context->damage != NULL) {
+    hash = agContextHashText(cr, text);
+
+    double x = 0.0, y = 0.0;
+
+    if (cairo_has_current_point(cr)) {
+      cairo_get_current_point(cr, &x, &y);
+    }
+
+    cairo_text_extents_t extents;
+    cairo_text_extents(cr, text, &extents);
+    agTextInk(cr, &extents, x, y, ink);
   }
+
+  agContextRecordInk(context, AG_DRAW_PAINT, hash, ink);
+  cairo_show_text(cr, text);
 }
 
-/*
- * Pattern
- */
+static void agContextTextExtents(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  const char *text = agateSlotGetString(vm, 1);
 
-struct Pattern {
-  cairo_pattern_t *ptr;
-};
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "TextExtents", class_slot);
 
-// class
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  cairo_text_extents_t *extents = agateSlotSetForeign(vm, result_slot, class_slot);
+  cairo_text_extents(context->ptr, text, extents);
 
-static ptrdiff_t agPatternAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return sizeof(struct Pattern);
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
 }
 
-static uint64_t agPatternTag(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return AG_PATTERN_TAG;
-}
+struct GlyphBuffer {
+  cairo_glyph_t *glyphs;
+  size_t count;
+  size_t capacity;
+};
 
-void agPatternDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
-  struct Pattern *pattern = data;
+static void agGlyphBufferReserve(struct GlyphBuffer *buffer, size_t additional) {
+  if (buffer->count + additional <= buffer->capacity) {
+    return;
+  }
 
-  if (pattern->ptr != NULL) {
-    cairo_pattern_destroy(pattern->ptr);
+  while (buffer->count + additional > buffer->capacity) {
+    buffer->capacity = buffer->capacity == 0 ? 256 : 2 * buffer->capacity;
   }
 
-  pattern->ptr = NULL;
+  buffer->glyphs = realloc(buffer->glyphs, buffer->capacity * sizeof(cairo_glyph_t));
+  assert(buffer->glyphs);
 }
 
-// methods
+static void agGlyphBufferAppendText(struct GlyphBuffer *buffer, struct GlyphCache *cache, const char *text, double x, double y) {
+  size_t length = strlen(text);
+  agGlyphBufferReserve(buffer, length);
 
-static void agPatternSetMatrix(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
-  cairo_matrix_t *matrix = agateSlotGetForeign(vm, 1);
-  cairo_pattern_set_matrix(pattern->ptr, matrix);
-}
+  size_t start = buffer->count;
 
-static void agSolidPatternNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 1);
-  pattern->ptr = cairo_pattern_create_rgba(color->r, color->g, color->b, color->a);
-}
+  for (size_t i = 0; i < length; ++i) {
+    if (!agGlyphCacheGet(cache, text[i])) {
+      // not a plain ASCII string, let cairo do the whole conversion
+      buffer->count = start;
+      cairo_glyph_t *glyphs = NULL;
+      int glyph_count = 0;
 
-static void agSurfacePatternNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
-  struct Surface *surface = agateSlotGetForeign(vm, 1);
-  pattern->ptr = cairo_pattern_create_for_surface(surface->ptr);
-}
+      if (cairo_scaled_font_text_to_glyphs(cache->font, x, y, text, (int) length, &glyphs, &glyph_count, NULL, NULL, NULL) == CAIRO_STATUS_SUCCESS) {
+        agGlyphBufferReserve(buffer, (size_t) glyph_count);
+        memcpy(buffer->glyphs + buffer->count, glyphs, (size_t) glyph_count * sizeof(cairo_glyph_t));
+        buffer->count += (size_t) glyph_count;
+      }
 
-static void agGradientPatternAddColor(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
-  double offset = agateSlotGetFloat(vm, 1);
-  assert(agateSlotGetForeignTag(vm, 2) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 2);
-  cairo_pattern_add_color_stop_rgba(pattern->ptr, offset, color->r, color->g, color->b, color->a);
-}
+      cairo_glyph_free(glyphs);
+      return;
+    }
 
-static void agLinearGradientPatternNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
-  struct Vector2 *p0 = agateSlotGetForeign(vm, 1);
-  assert(agateSlotGetForeignTag(vm, 2) == AG_VECTOR2_TAG);
-  struct Vector2 *p1 = agateSlotGetForeign(vm, 2);
-  pattern->ptr = cairo_pattern_create_linear(p0->x, p0->y, p1->x, p1->y);
+    unsigned char u = (unsigned char) text[i];
+    cairo_glyph_t *glyph = &buffer->glyphs[buffer->count++];
+    glyph->index = cache->index[u];
+    glyph->x = x;
+    glyph->y = y;
+    x += cache->advance_x[u];
+    y += cache->advance_y[u];
+  }
 }
 
-static void agRadialGradientPatternNew(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
-  struct Vector2 *c0 = agateSlotGetForeign(vm, 1);
-  double r0 = agateSlotGetFloat(vm, 2);
-  assert(agateSlotGetForeignTag(vm, 3) == AG_VECTOR2_TAG);
-  struct Vector2 *c1 = agateSlotGetForeign(vm, 3);
-  double r1 = agateSlotGetFloat(vm, 4);
-  pattern->ptr = cairo_pattern_create_radial(c0->x, c0->y, r0, c1->x, c1->y, r1);
-}
+static void agContextShowLabels(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 0);
+  ptrdiff_t texts_slot = 1;
+  ptrdiff_t positions_slot = 2;
 
-/*
- * Context
- */
+  ptrdiff_t count = agateSlotArraySize(vm, texts_slot);
 
-struct Context {
-  cairo_t *ptr;
-};
+  if (agateSlotArraySize(vm, positions_slot) != count) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "Texts and positions must have the same size");
+    agateAbort(vm, string_slot);
+    return;
+  }
 
-// class
+  struct GlyphCache *cache = agGlyphCacheLookup(cairo_get_scaled_font(context->ptr));
+  struct GlyphBuffer buffer = { NULL, 0, 0 };
 
-static ptrdiff_t agContextAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return sizeof(struct Context);
-}
+  ptrdiff_t text_slot = agateSlotAllocate(vm);
+  ptrdiff_t position_slot = agateSlotAllocate(vm);
 
-static uint64_t agContextTag(AgateVM *vm, const char *unit_name, const char *class_name) {
-  return AG_CONTEXT_TAG;
-}
+  for (ptrdiff_t i = 0; i < count; ++i) {
+    agateSlotArrayGet(vm, texts_slot, i, text_slot);
+    agateSlotArrayGet(vm, positions_slot, i, position_slot);
+    assert(agateSlotGetForeignTag(vm, position_slot) == AG_VECTOR2_TAG);
+    struct Vector2 *position = agateSlotGetForeign(vm, position_slot);
+    agGlyphBufferAppendText(&buffer, cache, agateSlotGetString(vm, text_slot), position->x, position->y);
+  }
 
-void agContextDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
-  struct Context *context = data;
+  if (buffer.count > 0) {
+    uint64_t hash = AG_HASH_SEED;
+    double ink[4] = { 0.0, 0.0, 0.0, 0.0 };
+
+    if (context->damage != NULL) {
+      cairo_matrix_t font_matrix;
+      cairo_get_font_matrix(context->ptr, &font_matrix);
+      hash = agHash(hash, buffer.glyphs, buffer.count * sizeof(cairo_glyph_t));
+      hash = agHashInt(hash, (int64_t) agFontFaceGeneration(cairo_get_font_face(context->ptr)));
+      hash = agHash(hash, &font_matrix, sizeof(font_matrix));
+
+      // glyph positions are absolute, the extents are relative to the origin
+      cairo_text_extents_t extents;
+      cairo_glyph_extents(context->ptr, buffer.glyphs, (int) buffer.count, &extents);
+      agTextInk(context->ptr, &extents, 0.0, 0.0, ink);
+    }
 
-  if (context->ptr != NULL) {
-    cairo_destroy(context->ptr);
+    agContextRecordInk(context, AG_DRAW_PAINT, hash, ink);
+
+    cairo_show_glyphs(context->ptr, buffer.glyphs, (int) buffer.count);
   }
 
-  context->ptr = NULL;
+  free(buffer.glyphs);
 }
 
-// methods
+// damage
 
-static void agContextNew(AgateVM *vm) {
+static void agContextTrackDamage(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
-  struct Surface *surface = agateSlotGetForeign(vm, 1);
-  context->ptr = cairo_create(surface->ptr);
+
+  if (context->damage == NULL) {
+    context->damage = calloc(1, sizeof(struct DamageLog));
+    assert(context->damage);
+  }
 }
 
-static void agContextSave(AgateVM *vm) {
+// path
+
+static void agContextSetPath(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  cairo_save(context->ptr);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_PATH_TAG);
+  struct Path *path = agateSlotGetForeign(vm, 1);
+  cairo_append_path(context->ptr, agPathToCairo(path));
 }
 
-static void agContextRestore(AgateVM *vm) {
+static void agContextCopyPath(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  cairo_restore(context->ptr);
-}
 
-// group
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Path *result = agSlotSetNewPath(vm, result_slot);
 
-static void agContextPushGroup(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  cairo_push_group(context->ptr);
+  cairo_path_t *path = cairo_copy_path(context->ptr);
+  agPathFromCairo(result, path);
+  cairo_path_destroy(path);
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
 }
 
-static void agContextPopGroupToSource(AgateVM *vm) {
+static void agContextCopyPathFlat(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  cairo_pop_group_to_source(context->ptr);
-}
 
-// matrix
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Path *result = agSlotSetNewPath(vm, result_slot);
 
-static void agContextTranslate(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double tx = agateSlotGetFloat(vm, 1);
-  double ty = agateSlotGetFloat(vm, 2);
-  cairo_translate(context->ptr, tx, ty);
-}
+  cairo_path_t *path = cairo_copy_path_flat(context->ptr);
+  agPathFromCairo(result, path);
+  cairo_path_destroy(path);
 
-static void agContextScale(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double sx = agateSlotGetFloat(vm, 1);
-  double sy = agateSlotGetFloat(vm, 2);
-  cairo_scale(context->ptr, sx, sy);
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
 }
 
-static void agContextRotate(AgateVM *vm) {
+static void agContextFillStroked(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  double angle = agateSlotGetFloat(vm, 1);
-  cairo_rotate(context->ptr, angle);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_STROKED_TAG);
+  struct StrokedPath *stroked = agateSlotGetForeign(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_VECTOR2_TAG);
+  struct Vector2 *position = agateSlotGetForeign(vm, 2);
+
+  cairo_t *cr = context->ptr;
+  struct Path *outline = agStrokedPathGetOutline(stroked, agStrokeUserTolerance(cr));
+
+  // the path is converted to device space when appended, the matrix can be restored just after
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  cairo_translate(cr, position->x, position->y);
+  cairo_new_path(cr);
+  cairo_append_path(cr, agPathToCairo(outline));
+  cairo_set_matrix(cr, &matrix);
+
+  cairo_fill_rule_t fill_rule = cairo_get_fill_rule(cr);
+  cairo_set_fill_rule(cr, CAIRO_FILL_RULE_WINDING);
+  agContextIndexShape(context, AG_SHAPE_FILL);
+  agContextRecordOp(context, AG_DRAW_FILL, AG_HASH_SEED);
+  cairo_fill(cr);
+  cairo_set_fill_rule(cr, fill_rule);
 }
 
-// source
+// plots
 
-static void agContextSetSourceColor(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_COLOR_TAG);
-  struct Color *color = agateSlotGetForeign(vm, 1);
-  cairo_set_source_rgba(context->ptr, color->r, color->g, color->b, color->a);
+static void agContextPlotDeviceMatrix(cairo_t *cr, const cairo_matrix_t *data, cairo_matrix_t *ctm, cairo_matrix_t *result) {
+  // the path is built in device space, the user matrix is restored after
+  cairo_get_matrix(cr, ctm);
+  cairo_matrix_multiply(result, data, ctm);
+  cairo_identity_matrix(cr);
 }
 
-static void agContextSetSourceSurface(AgateVM *vm) {
+static void agContextPlotLines(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
-  struct Surface *surface = agateSlotGetForeign(vm, 1);
-  double x = agateSlotGetFloat(vm, 2);
-  double y = agateSlotGetFloat(vm, 3);
-  cairo_set_source_surface(context->ptr, surface->ptr, x, y);
-}
+  assert(agateSlotGetForeignTag(vm, 3) == AG_MATRIX_TAG);
+  cairo_matrix_t *data = agateSlotGetForeign(vm, 3);
 
-static void agContextSetSourcePattern(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  assert(agateSlotGetForeignTag(vm, 1) == AG_PATTERN_TAG);
-  struct Pattern *pattern = agateSlotGetForeign(vm, 1);
-  cairo_set_source(context->ptr, pattern->ptr);
-}
+  struct FloatView xs, ys;
 
-// style
+  if (!agSlotGetFloatColumns(vm, 1, &xs, &ys)) {
+    return;
+  }
 
-static void agContextSetAntialias(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  int64_t raw = agateSlotGetInt(vm, 1);
-  cairo_set_antialias(context->ptr, (cairo_antialias_t) raw);
+  cairo_matrix_t ctm, matrix;
+  struct PlotRange range;
+  agContextPlotDeviceMatrix(context->ptr, data, &ctm, &matrix);
+  agPlotRangeInit(&range, context->ptr, &ctm);
+  agPlotLines(context->ptr, &matrix, &range, xs.data, ys.data, xs.size);
+  cairo_set_matrix(context->ptr, &ctm);
+
+  agFloatViewRelease(&xs);
+  agFloatViewRelease(&ys);
 }
 
-static void agContextSetFillRule(AgateVM *vm) {
+static void agContextPlotBars(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  int64_t raw = agateSlotGetInt(vm, 1);
-  cairo_set_fill_rule(context->ptr, (cairo_fill_rule_t) raw);
+  double width = agSlotGetNumber(vm, 3);
+  assert(agateSlotGetForeignTag(vm, 4) == AG_MATRIX_TAG);
+  cairo_matrix_t *data = agateSlotGetForeign(vm, 4);
+
+  struct FloatView xs, heights;
+
+  if (!agSlotGetFloatColumns(vm, 1, &xs, &heights)) {
+    return;
+  }
+
+  cairo_matrix_t ctm, matrix;
+  struct PlotRange range;
+  agContextPlotDeviceMatrix(context->ptr, data, &ctm, &matrix);
+  agPlotRangeInit(&range, context->ptr, &ctm);
+  agPlotBars(context->ptr, &matrix, &range, xs.data, heights.data, xs.size, width);
+  cairo_set_matrix(context->ptr, &ctm);
+
+  agFloatViewRelease(&xs);
+  agFloatViewRelease(&heights);
 }
 
-static void agContextSetLineCap(AgateVM *vm) {
+// state
+
+static void agContextSkippedCallsGetter(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  int64_t raw = agateSlotGetInt(vm, 1);
-  cairo_set_line_cap(context->ptr, (cairo_line_cap_t) raw);
+  agateSlotSetInt(vm, AGATE_RETURN_SLOT, context->skipped_calls);
 }
 
-static void agContextSetLineJoin(AgateVM *vm) {
+// spatial index
+
+static void agContextSetTag(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  int64_t raw = agateSlotGetInt(vm, 1);
-  cairo_set_line_join(context->ptr, (cairo_line_join_t) raw);
+
+  if (agateSlotType(vm, 1) == AGATE_TYPE_NIL) {
+    context->tagged = false;
+    context->tag = 0;
+  } else {
+    context->tagged = true;
+    context->tag = agateSlotGetInt(vm, 1);
+  }
 }
 
-static void agContextSetLineWidth(AgateVM *vm) {
+static void agContextHitTest(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  double width = agateSlotGetFloat(vm, 1);
-  cairo_set_line_width(context->ptr, width);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *point = agateSlotGetForeign(vm, 1);
+
+  const struct Shape *shape = NULL;
+
+  if (context->index != NULL && context->index->shape_count > 0) {
+    shape = agSpatialIndexHitTest(context->index, point->x, point->y);
+  }
+
+  if (shape != NULL) {
+    agateSlotSetInt(vm, AGATE_RETURN_SLOT, shape->tag);
+  } else {
+    agateSlotSetNil(vm, AGATE_RETURN_SLOT);
+  }
 }
 
-static void agContextSetMiterLimit(AgateVM *vm) {
+static void agContextQuery(AgateVM *vm) {
   assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
   struct Context *context = agateSlotGetForeign(vm, 0);
-  double limit = agateSlotGetFloat(vm, 1);
-  cairo_set_miter_limit(context->ptr, limit);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_VECTOR2_TAG);
+  struct Vector2 *position = agateSlotGetForeign(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_VECTOR2_TAG);
+  struct Vector2 *size = agateSlotGetForeign(vm, 2);
+
+  ptrdiff_t array_slot = agateSlotAllocate(vm);
+  agateSlotArrayNew(vm, array_slot);
+
+  if (context->index != NULL && context->index->shape_count > 0) {
+    int64_t *tags = NULL;
+    size_t count = agSpatialIndexQuery(context->index, position->x, position->y, position->x + size->x, position->y + size->y, &tags);
+    ptrdiff_t element_slot = agateSlotAllocate(vm);
+
+    for (size_t i = 0; i < count; ++i) {
+      agateSlotSetInt(vm, element_slot, tags[i]);
+      agateSlotArrayInsert(vm, array_slot, -1, element_slot);
+    }
+
+    free(tags);
+  }
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, array_slot);
 }
 
-static void agContextSetOperator(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  int64_t raw = agateSlotGetInt(vm, 1);
-  cairo_set_operator(context->ptr, (cairo_operator_t) raw);
+/*
+ * Preview
+ */
+
+struct DirtyRect {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct Preview {
+  cairo_surface_t *target;
+  int width;
+  int height;
+  int tile_size;
+  bool first;
+  struct DamageLog previous;
+};
+
+static void agPreviewMarkTiles(const struct Preview *preview, bool *tiles, int columns, int rows, const struct DrawOp *op) {
+  double x1 = max2(op->x1, 0.0);
+  double y1 = max2(op->y1, 0.0);
+  double x2 = min2(op->x2, preview->width);
+  double y2 = min2(op->y2, preview->height);
+
+  if (x1 >= x2 || y1 >= y2) {
+    return;
+  }
+
+  int column_min = (int) (x1 / preview->tile_size);
+  int column_max = (int) ceil(x2 / preview->tile_size) - 1;
+  int row_min = (int) (y1 / preview->tile_size);
+  int row_max = (int) ceil(y2 / preview->tile_size) - 1;
+
+  for (int row = row_min; row <= row_max && row < rows; ++row) {
+    for (int column = column_min; column <= column_max && column < columns; ++column) {
+      tiles[row * columns + column] = true;
+    }
+  }
 }
 
-// draw
+// the operations that differ between the two frames, once the common prefix and suffix are removed
+static void agPreviewDiff(const struct Preview *preview, const struct DamageLog *current, bool *tiles, int columns, int rows) {
+  const struct DamageLog *previous = &preview->previous;
 
-static void agContextClip(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  bool preserve = agateSlotGetBool(vm, 1);
+  if (preview->first) {
+    memset(tiles, 1, (size_t) columns * (size_t) rows * sizeof(bool));
+    return;
+  }
 
-  if (preserve) {
-    cairo_clip_preserve(context->ptr);
-  } else {
-    cairo_clip(context->ptr);
+  size_t prefix = 0;
+
+  while (prefix < previous->count && prefix < current->count && previous->ops[prefix].hash == current->ops[prefix].hash) {
+    ++prefix;
   }
-}
 
-static void agContextFill(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  bool preserve = agateSlotGetBool(vm, 1);
+  size_t suffix = 0;
 
-  if (preserve) {
-    cairo_fill_preserve(context->ptr);
-  } else {
-    cairo_fill(context->ptr);
+  while (suffix < previous->count - prefix && suffix < current->count - prefix
+      && previous->ops[previous->count - 1 - suffix].hash == current->ops[current->count - 1 - suffix].hash) {
+    ++suffix;
   }
-}
 
-static void agContextStroke(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  bool preserve = agateSlotGetBool(vm, 1);
+  for (size_t i = prefix; i < previous->count - suffix; ++i) {
+    agPreviewMarkTiles(preview, tiles, columns, rows, &previous->ops[i]);
+  }
 
-  if (preserve) {
-    cairo_stroke_preserve(context->ptr);
-  } else {
-    cairo_stroke(context->ptr);
+  for (size_t i = prefix; i < current->count - suffix; ++i) {
+    agPreviewMarkTiles(preview, tiles, columns, rows, &current->ops[i]);
   }
 }
 
-static void agContextPaint(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  cairo_paint(context->ptr);
+// class
+
+static ptrdiff_t agPreviewAllocate(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return sizeof(struct Preview);
 }
 
-static void agContextPaintWithAlpha(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double alpha = agateSlotGetFloat(vm, 1);
-  cairo_paint_with_alpha(context->ptr, alpha);
+static uint64_t agPreviewTag(AgateVM *vm, const char *unit_name, const char *class_name) {
+  return AG_PREVIEW_TAG;
 }
 
-// path
+void agPreviewDestroy(AgateVM *vm, const char *unit_name, const char *class_name, void *data) {
+  struct Preview *preview = data;
 
-static void agContextMoveTo(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double x = agateSlotGetFloat(vm, 1);
-  double y = agateSlotGetFloat(vm, 2);
-  cairo_move_to(context->ptr, x, y);
-}
+  if (preview->target != NULL) {
+    cairo_surface_destroy(preview->target);
+  }
 
-static void agContextLineTo(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double x = agateSlotGetFloat(vm, 1);
-  double y = agateSlotGetFloat(vm, 2);
-  cairo_line_to(context->ptr, x, y);
+  agDamageLogRelease(&preview->previous);
+  preview->target = NULL;
 }
 
-static void agContextCurveTo(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double x1 = agateSlotGetFloat(vm, 1);
-  double y1 = agateSlotGetFloat(vm, 2);
-  double x2 = agateSlotGetFloat(vm, 3);
-  double y2 = agateSlotGetFloat(vm, 4);
-  double x3 = agateSlotGetFloat(vm, 5);
-  double y3 = agateSlotGetFloat(vm, 6);
-  cairo_curve_to(context->ptr, x1, y1, x2, y2, x3, y3);
-}
+// methods
 
-static void agContextClosePath(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  cairo_close_path(context->ptr);
+static void agPreviewNew(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PREVIEW_TAG);
+  struct Preview *preview = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_SURFACE_TAG);
+  struct Surface *surface = agateSlotGetForeign(vm, 1);
+  int64_t tile_size = agateSlotGetInt(vm, 2);
+
+  agSurfaceMakeWritable(surface);
+  preview->target = cairo_surface_reference(surface->ptr);
+  preview->width = cairo_image_surface_get_width(surface->ptr);
+  preview->height = cairo_image_surface_get_height(surface->ptr);
+  preview->tile_size = tile_size > 0 ? (int) tile_size : 64;
+  preview->first = true;
+  preview->previous.ops = NULL;
+  preview->previous.count = preview->previous.capacity = 0;
 }
 
-static void agContextRectangle(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double x = agateSlotGetFloat(vm, 1);
-  double y = agateSlotGetFloat(vm, 2);
-  double width = agateSlotGetFloat(vm, 3);
-  double height = agateSlotGetFloat(vm, 4);
-  cairo_rectangle(context->ptr, x, y, width, height);
-}
+static void agPreviewSizeGetter(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PREVIEW_TAG);
+  struct Preview *preview = agateSlotGetForeign(vm, 0);
 
-static void agContextArc(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double xc = agateSlotGetFloat(vm, 1);
-  double yc = agateSlotGetFloat(vm, 2);
-  double radius = agateSlotGetFloat(vm, 3);
-  double angle1 = agateSlotGetFloat(vm, 4);
-  double angle2 = agateSlotGetFloat(vm, 5);
-  cairo_arc(context->ptr, xc, yc, radius, angle1, angle2);
-}
+  ptrdiff_t class_slot = agateSlotAllocate(vm);
+  agateGetVariable(vm, "agraphics", "Vector2", class_slot);
 
-static void agContextArcNegative(AgateVM *vm) {
-  assert(agateSlotGetForeignTag(vm, 0) == AG_CONTEXT_TAG);
-  struct Context *context = agateSlotGetForeign(vm, 0);
-  double xc = agateSlotGetFloat(vm, 1);
-  double yc = agateSlotGetFloat(vm, 2);
-  double radius = agateSlotGetFloat(vm, 3);
-  double angle1 = agateSlotGetFloat(vm, 4);
-  double angle2 = agateSlotGetFloat(vm, 5);
-  cairo_arc_negative(context->ptr, xc, yc, radius, angle1, angle2);
+  ptrdiff_t result_slot = agateSlotAllocate(vm);
+  struct Vector2 *size = agateSlotSetForeign(vm, result_slot, class_slot);
+  size->x = preview->width;
+  size->y = preview->height;
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, result_slot);
 }
 
+static void agPreviewCommit(AgateVM *vm) {
+  assert(agateSlotGetForeignTag(vm, 0) == AG_PREVIEW_TAG);
+  struct Preview *preview = agateSlotGetForeign(vm, 0);
+  assert(agateSlotGetForeignTag(vm, 1) == AG_CONTEXT_TAG);
+  struct Context *context = agateSlotGetForeign(vm, 1);
+  assert(agateSlotGetForeignTag(vm, 2) == AG_SURFACE_TAG);
+  struct Surface *recording = agateSlotGetForeign(vm, 2);
+
+  ptrdiff_t array_slot = agateSlotAllocate(vm);
+  agateSlotArrayNew(vm, array_slot);
+
+  if (context->damage == NULL) {
+    ptrdiff_t string_slot = agateSlotAllocate(vm);
+    agateSlotSetString(vm, string_slot, "The context does not track damage");
+    agateAbort(vm, string_slot);
+    return;
+  }
+
+  int columns = (preview->width + preview->tile_size - 1) / preview->tile_size;
+  int rows = (preview->height + preview->tile_size - 1) / preview->tile_size;
+  bool *tiles = calloc((size_t) columns * (size_t) rows + 1, sizeof(bool));
+  assert(tiles);
+
+  cairo_surface_flush(recording->ptr);
+  agPreviewDiff(preview, context->damage, tiles, columns, rows);
+
+  // merge the dirty tiles of each row in runs, and replay the frame in them
+
+  cairo_t *cr = cairo_create(preview->target);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, recording->ptr, 0.0, 0.0);
+
+  ptrdiff_t rect_slot = agateSlotAllocate(vm);
+  ptrdiff_t value_slot = agateSlotAllocate(vm);
+
+  for (int row = 0; row < rows; ++row) {
+    int column = 0;
+
+    while (column < columns) {
+      if (!tiles[row * columns + column]) {
+        ++column;
+        continue;
+      }
+
+      int start = column;
+
+      while (column < columns && tiles[row * columns + column]) {
+        ++column;
+      }
+
+      struct DirtyRect rect;
+      rect.x = start * preview->tile_size;
+      rect.y = row * preview->tile_size;
+      rect.width = (column * preview->tile_size < preview->width ? column * preview->tile_size : preview->width) - rect.x;
+      rect.height = ((row + 1) * preview->tile_size < preview->height ? (row + 1) * preview->tile_size : preview->height) - rect.y;
+
+      cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+      cairo_save(cr);
+      cairo_clip(cr);
+      cairo_paint(cr);
+      cairo_restore(cr);
+
+      const int values[4] = { rect.x, rect.y, rect.width, rect.height };
+      agateSlotArrayNew(vm, rect_slot);
+
+      for (int i = 0; i < 4; ++i) {
+        agateSlotSetInt(vm, value_slot, values[i]);
+        agateSlotArrayInsert(vm, rect_slot, -1, value_slot);
+      }
+
+      agateSlotArrayInsert(vm, array_slot, -1, rect_slot);
+    }
+  }
+
+  cairo_destroy(cr);
+  free(tiles);
+
+  // the operations of this frame are the reference for the next one
+  agDamageLogRelease(&preview->previous);
+  preview->previous = *context->damage;
+  context->damage->ops = NULL;
+  context->damage->count = context->damage->capacity = 0;
+  preview->first = false;
+
+  agateSlotCopy(vm, AGATE_RETURN_SLOT, array_slot);
+}
 
 /*
  * Agate configuration
@@ -813,6 +5960,27 @@ static AgateForeignClassHandler agClassHandler(AgateVM *vm, const char *unit_nam
   assert(equals(unit_name, "agraphics"));
   AgateForeignClassHandler handler = { NULL, NULL, NULL };
 
+  if (equals(class_name, "FloatBuffer")) {
+    handler.allocate = agFloatBufferAllocate;
+    handler.tag = agFloatBufferTag;
+    handler.destroy = agFloatBufferDestroy;
+    return handler;
+  }
+
+  if (equals(class_name, "Path")) {
+    handler.allocate = agPathAllocate;
+    handler.tag = agPathTag;
+    handler.destroy = agPathDestroy;
+    return handler;
+  }
+
+  if (equals(class_name, "StrokedPath")) {
+    handler.allocate = agStrokedPathAllocate;
+    handler.tag = agStrokedPathTag;
+    handler.destroy = agStrokedPathDestroy;
+    return handler;
+  }
+
   if (equals(class_name, "Vector2")) {
     handler.allocate = agVector2Allocate;
     handler.tag = agVector2Tag;
@@ -838,6 +6006,33 @@ static AgateForeignClassHandler agClassHandler(AgateVM *vm, const char *unit_nam
     return handler;
   }
 
+  if (equals(class_name, "Heatmap")) {
+    handler.allocate = agHeatmapAllocate;
+    handler.tag = agHeatmapTag;
+    handler.destroy = agHeatmapDestroy;
+    return handler;
+  }
+
+  if (equals(class_name, "SpriteAtlas")) {
+    handler.allocate = agSpriteAtlasAllocate;
+    handler.tag = agSpriteAtlasTag;
+    handler.destroy = agSpriteAtlasDestroy;
+    return handler;
+  }
+
+  if (equals(class_name, "Font")) {
+    handler.allocate = agFontAllocate;
+    handler.tag = agFontTag;
+    handler.destroy = agFontDestroy;
+    return handler;
+  }
+
+  if (equals(class_name, "TextExtents")) {
+    handler.allocate = agTextExtentsAllocate;
+    handler.tag = agTextExtentsTag;
+    return handler;
+  }
+
   if (equals(class_name, "Context")) {
     handler.allocate = agContextAllocate;
     handler.tag = agContextTag;
@@ -845,6 +6040,13 @@ static AgateForeignClassHandler agClassHandler(AgateVM *vm, const char *unit_nam
     return handler;
   }
 
+  if (equals(class_name, "Preview")) {
+    handler.allocate = agPreviewAllocate;
+    handler.tag = agPreviewTag;
+    handler.destroy = agPreviewDestroy;
+    return handler;
+  }
+
   if (equals(class_name, "SolidPattern") || equals(class_name, "SurfacePattern") || equals(class_name, "LinearGradientPattern") || equals(class_name, "RadialGradientPattern")) {
     handler.allocate = agPatternAllocate;
     handler.tag = agPatternTag;
@@ -858,6 +6060,38 @@ static AgateForeignClassHandler agClassHandler(AgateVM *vm, const char *unit_nam
 static AgateForeignMethodFunc agMethodHandler(AgateVM *vm, const char *unit_name, const char *class_name, AgateForeignMethodKind kind, const char *signature) {
   assert(equals(unit_name, "agraphics"));
 
+  if (equals(class_name, "FloatBuffer")) {
+    if (equals(signature, "init new()")) { return agFloatBufferNew; }
+    if (equals(signature, "init new(_)")) { return agFloatBufferNewSized; }
+    if (equals(signature, "size")) { return agFloatBufferSizeGetter; }
+    if (equals(signature, "[_]")) { return agFloatBufferSubscriptGetter; }
+    if (equals(signature, "[_]=(_)")) { return agFloatBufferSubscriptSetter; }
+    if (equals(signature, "push(_)")) { return agFloatBufferPush; }
+    if (equals(signature, "clear()")) { return agFloatBufferClear; }
+  }
+
+  if (equals(class_name, "Path")) {
+    if (equals(signature, "init new()")) { return agPathNew; }
+    if (equals(signature, "move_to(_)")) { return agPathMoveTo; }
+    if (equals(signature, "line_to(_)")) { return agPathLineTo; }
+    if (equals(signature, "curve_to(_,_,_)")) { return agPathCurveTo; }
+    if (equals(signature, "rel_move_to(_)")) { return agPathRelMoveTo; }
+    if (equals(signature, "rel_line_to(_)")) { return agPathRelLineTo; }
+    if (equals(signature, "rel_curve_to(_,_,_)")) { return agPathRelCurveTo; }
+    if (equals(signature, "close()")) { return agPathClose; }
+    if (equals(signature, "command_count")) { return agPathCommandCountGetter; }
+    if (equals(signature, "command(_)")) { return agPathCommand; }
+    if (equals(signature, "point(_)")) { return agPathPoint; }
+    if (equals(signature, "flatten(_)")) { return agPathFlatten; }
+    if (equals(signature, "simplify(_)")) { return agPathSimplify; }
+  }
+
+  if (equals(class_name, "StrokedPath")) {
+    if (equals(signature, "init new(_,_,_,_)")) { return agStrokedPathNew; }
+    if (equals(signature, "init new(_,_,_,_,_)")) { return agStrokedPathNewWithMiterLimit; }
+    if (equals(signature, "outline")) { return agStrokedPathOutlineGetter; }
+  }
+
   if (equals(class_name, "Vector2")) {
     if (equals(signature, "init new(_,_)")) { return agVector2New; }
     if (equals(signature, "x")) { return agVector2XGetter; }
@@ -895,11 +6129,26 @@ static AgateForeignMethodFunc agMethodHandler(AgateVM *vm, const char *unit_name
   if (equals(class_name, "Surface")) {
     if (equals(signature, "init new(_)")) { return agSurfaceNew; }
     if (equals(signature, "init new_from_png(_)")) { return agSurfaceNewFromPng; }
+    if (equals(signature, "set_image_cache_budget(_)")) { return agSurfaceSetImageCacheBudget; }
+    if (equals(signature, "init new_svg(_,_)")) { return agSurfaceNewSvg; }
+    if (equals(signature, "init new_pdf(_,_)")) { return agSurfaceNewPdf; }
+    if (equals(signature, "size")) { return agSurfaceSizeGetter; }
+    if (equals(signature, "resize(_,_)")) { return agSurfaceResize; }
+    if (equals(signature, "build_mipmaps()")) { return agSurfaceBuildMipmaps; }
     if (equals(signature, "export(_)")) { return agSurfaceExport; }
+    if (equals(signature, "export_raw(_)")) { return agSurfaceExportRaw; }
+    if (equals(signature, "export_tiles(_,_,_)")) { return agSurfaceExportTiles; }
+    if (equals(signature, "composite(_,_,_,_,_)")) { return agSurfaceComposite; }
+    if (equals(signature, "show_page()")) { return agSurfaceShowPage; }
+    if (equals(signature, "set_page_size(_)")) { return agSurfaceSetPageSize; }
+    if (equals(signature, "finish()")) { return agSurfaceFinish; }
+    if (equals(signature, "init new_recording(_)")) { return agSurfaceNewRecording; }
+    if (equals(signature, "init new_banded(_,_)")) { return agSurfaceNewBanded; }
   }
 
   if (equals(class_name, "Pattern")) {
     if (equals(signature, "set_matrix(_)")) { return agPatternSetMatrix; }
+    if (equals(signature, "set_extend(_)")) { return agPatternSetExtend; }
   }
 
   if (equals(class_name, "SolidPattern")) {
@@ -908,6 +6157,7 @@ static AgateForeignMethodFunc agMethodHandler(AgateVM *vm, const char *unit_name
 
   if (equals(class_name, "SurfacePattern")) {
     if (equals(signature, "init new(_)")) { return agSurfacePatternNew; }
+    if (equals(signature, "set_filter(_)")) { return agSurfacePatternSetFilter; }
   }
 
   if (equals(class_name, "GradientPattern")) {
@@ -922,6 +6172,34 @@ static AgateForeignMethodFunc agMethodHandler(AgateVM *vm, const char *unit_name
     if (equals(signature, "init new(_,_,_,_)")) { return agRadialGradientPatternNew; }
   }
 
+  if (equals(class_name, "SpriteAtlas")) {
+    if (equals(signature, "init new(_)")) { return agSpriteAtlasNew; }
+    if (equals(signature, "add(_)")) { return agSpriteAtlasAdd; }
+    if (equals(signature, "count")) { return agSpriteAtlasCountGetter; }
+  }
+
+  if (equals(class_name, "Heatmap")) {
+    if (equals(signature, "init new(_,_)")) { return agHeatmapNew; }
+    if (equals(signature, "add_points(_,_,_,_)")) { return agHeatmapAddPoints; }
+    if (equals(signature, "clear()")) { return agHeatmapClear; }
+    if (equals(signature, "max")) { return agHeatmapMaxGetter; }
+    if (equals(signature, "colorize(_,_)")) { return agHeatmapColorize; }
+    if (equals(signature, "size")) { return agHeatmapSizeGetter; }
+  }
+
+  if (equals(class_name, "Font")) {
+    if (equals(signature, "init new(_,_,_)")) { return agFontNew; }
+  }
+
+  if (equals(class_name, "TextExtents")) {
+    if (equals(signature, "x_bearing")) { return agTextExtentsXBearingGetter; }
+    if (equals(signature, "y_bearing")) { return agTextExtentsYBearingGetter; }
+    if (equals(signature, "width")) { return agTextExtentsWidthGetter; }
+    if (equals(signature, "height")) { return agTextExtentsHeightGetter; }
+    if (equals(signature, "x_advance")) { return agTextExtentsXAdvanceGetter; }
+    if (equals(signature, "y_advance")) { return agTextExtentsYAdvanceGetter; }
+  }
+
   if (equals(class_name, "Context")) {
     if (equals(signature, "init new(_)")) { return agContextNew; }
     if (equals(signature, "save()")) { return agContextSave; }
@@ -953,20 +6231,43 @@ static AgateForeignMethodFunc agMethodHandler(AgateVM *vm, const char *unit_name
     if (equals(signature, "rectangle(_,_,_,_)")) { return agContextRectangle; }
     if (equals(signature, "arc(_,_,_,_,_)")) { return agContextArc; }
     if (equals(signature, "arc_negative(_,_,_,_,_)")) { return agContextArcNegative; }
+    if (equals(signature, "draw_sprites(_,_)")) { return agContextDrawSprites; }
+    if (equals(signature, "set_font(_)")) { return agContextSetFont; }
+    if (equals(signature, "set_font_size(_)")) { return agContextSetFontSize; }
+    if (equals(signature, "show_text(_)")) { return agContextShowText; }
+    if (equals(signature, "text_extents(_)")) { return agContextTextExtents; }
+    if (equals(signature, "show_labels(_,_)")) { return agContextShowLabels; }
+    if (equals(signature, "set_path(_)")) { return agContextSetPath; }
+    if (equals(signature, "copy_path()")) { return agContextCopyPath; }
+    if (equals(signature, "copy_path_flat()")) { return agContextCopyPathFlat; }
+    if (equals(signature, "fill_stroked(_,_)")) { return agContextFillStroked; }
+    if (equals(signature, "skipped_calls")) { return agContextSkippedCallsGetter; }
+    if (equals(signature, "plot_lines(_,_,_)")) { return agContextPlotLines; }
+    if (equals(signature, "plot_bars(_,_,_,_)")) { return agContextPlotBars; }
+    if (equals(signature, "track_damage()")) { return agContextTrackDamage; }
+    if (equals(signature, "set_tag(_)")) { return agContextSetTag; }
+    if (equals(signature, "hit_test(_)")) { return agContextHitTest; }
+    if (equals(signature, "query(_,_)")) { return agContextQuery; }
+  }
+
+  if (equals(class_name, "Preview")) {
+    if (equals(signature, "init new(_,_)")) { return agPreviewNew; }
+    if (equals(signature, "size")) { return agPreviewSizeGetter; }
+    if (equals(signature, "commit(_,_)")) { return agPreviewCommit; }
   }
 
   return NULL;
 }
 
 static void usage(void) {
-  printf("Usage: agraphics <unit>\n");
+  printf("Usage: agraphics [--watch] <unit>\n");
 }
 
 static void print(AgateVM *vm, const char* text) {
   fputs(text, stdout);
 }
 
-static void write(AgateVM *vm, uint8_t byte) {
+static void write_byte(AgateVM *vm, uint8_t byte) {
   fputc(byte, stdout);
 }
 
@@ -988,12 +6289,160 @@ static void input(AgateVM *vm, char *buffer, size_t size) {
   fgets(buffer, size, stdin);
 }
 
+static AgateVM *agCreateVM(AgateConfig *config) {
+  AgateVM *vm = agateExNewVM(config);
+
+  agateExUnitAddIncludePath(vm, AGRAPHICS_UNIT_DIRECTORY);
+  agateExUnitAddIncludePath(vm, ".");
+
+  agateExForeignClassAddHandler(vm, agClassHandler, "agraphics");
+  agateExForeignMethodAddHandler(vm, agMethodHandler, "agraphics");
+
+  return vm;
+}
+
+static bool agRunUnit(AgateVM *vm, const char *unit_name) {
+  const char *source = agateExUnitLoad(vm, unit_name);
+
+  if (source == NULL) {
+    fprintf(stderr, "Could not find agraphics unit '%s'.\n", unit_name);
+    return false;
+  }
+
+  AgateStatus status = agateCallString(vm, unit_name, source);
+  agateExUnitRelease(vm, source);
+
+  if (status != AGATE_STATUS_OK) {
+    fprintf(stderr, "Error in the agraphics unit '%s'.\n", unit_name);
+    return false;
+  }
+
+  return true;
+}
+
+#ifdef AGRAPHICS_HAS_INOTIFY
+static bool agHasSuffix(const char *text, const char *suffix) {
+  size_t text_length = strlen(text);
+  size_t suffix_length = strlen(suffix);
+  return text_length >= suffix_length && equals(text + text_length - suffix_length, suffix);
+}
+
+// returns true if something was read, sets the flags according to the changed units
+// unit_watch is the watch of the directory of the unit, the same name may exist in the other watched directory
+static bool agWatchRead(int fd, int unit_watch, const char *unit_file, bool *unit_changed, bool *include_changed) {
+  _Alignas(struct inotify_event) char buffer[4096];
+  ssize_t length = read(fd, buffer, sizeof(buffer));
+
+  if (length <= 0) {
+    return false;
+  }
+
+  for (char *ptr = buffer; ptr < buffer + length; ) {
+    const struct inotify_event *event = (const struct inotify_event *) ptr;
+
+    if (event->len > 0 && agHasSuffix(event->name, ".agate")) {
+      if (event->wd == unit_watch && equals(event->name, unit_file)) {
+        *unit_changed = true;
+      } else {
+        *include_changed = true;
+      }
+    }
+
+    ptr += sizeof(struct inotify_event) + event->len;
+  }
+
+  return true;
+}
+
+static int agWatch(AgateConfig *config, const char *unit_name) {
+  // the unit is looked up relative to the current directory
+  const char *separator = strrchr(unit_name, '/');
+  char directory[1024] = ".";
+  char unit_file[1024];
+
+  if (separator == unit_name || (separator != NULL && separator[1] == '\0')) {
+    fprintf(stderr, "Invalid unit name '%s'.\n", unit_name);
+    return EXIT_FAILURE;
+  }
+
+  if (separator != NULL) {
+    snprintf(directory, sizeof(directory), "%.*s", (int) (separator - unit_name), unit_name);
+  }
+
+  snprintf(unit_file, sizeof(unit_file), "%s.agate", separator != NULL ? separator + 1 : unit_name);
+
+  int fd = inotify_init();
+  int unit_watch = fd < 0 ? -1 : inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+  if (unit_watch < 0) {
+    fprintf(stderr, "Could not watch the directory '%s'.\n", directory);
+
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    return EXIT_FAILURE;
+  }
+
+  // the include paths of the VM, a missing directory is not an error
+  inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+  inotify_add_watch(fd, AGRAPHICS_UNIT_DIRECTORY, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+  AgateVM *vm = agCreateVM(config);
+  agRunUnit(vm, unit_name);
+
+  for (;;) {
+    bool unit_changed = false;
+    bool include_changed = false;
+
+    if (!agWatchRead(fd, unit_watch, unit_file, &unit_changed, &include_changed)) {
+      break;
+    }
+
+    // an editor may emit several events for a single save
+    struct pollfd pending = { fd, POLLIN, 0 };
+
+    while (poll(&pending, 1, 50) > 0) {
+      agWatchRead(fd, unit_watch, unit_file, &unit_changed, &include_changed);
+    }
+
+    if (!unit_changed && !include_changed) {
+      continue;
+    }
+
+    // the VM stays warm when only the unit changed, agraphics and the other imports are not compiled again
+    if (!include_changed) {
+      fprintf(stderr, "Reloading '%s'.\n", unit_name);
+
+      if (agRunUnit(vm, unit_name)) {
+        continue;
+      }
+    }
+
+    // an imported unit can not be replaced in a VM, neither can a unit that failed halfway
+    // the image and font caches are process-wide
+    fprintf(stderr, "Reloading all units.\n");
+    agateExDeleteVM(vm);
+    vm = agCreateVM(config);
+    agRunUnit(vm, unit_name);
+  }
+
+  agateExDeleteVM(vm);
+  close(fd);
+  return EXIT_SUCCESS;
+}
+#endif
+
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  bool watch = argc == 3 && equals(argv[1], "--watch");
+
+  if (argc != 2 && !watch) {
     usage();
     return EXIT_FAILURE;
   }
 
+  const char *unit_name = argv[argc - 1];
+
   AgateConfig config;
   agateConfigInitialize(&config);
 
@@ -1002,32 +6451,21 @@ int main(int argc, char *argv[]) {
   config.foreign_method_handler = agateExForeignMethodHandler;
 
   config.print = print;
-  config.write = write;
+  config.write = write_byte;
   config.error = error;
   config.input = input;
 
-  AgateVM *vm = agateExNewVM(&config);
-
-  agateExUnitAddIncludePath(vm, AGRAPHICS_UNIT_DIRECTORY);
-  agateExUnitAddIncludePath(vm, ".");
-
-  agateExForeignClassAddHandler(vm, agClassHandler, "agraphics");
-  agateExForeignMethodAddHandler(vm, agMethodHandler, "agraphics");
-
-  const char *source = agateExUnitLoad(vm, argv[1]);
-
-  if (source != NULL) {
-    AgateStatus status = agateCallString(vm, argv[1], source);
-    agateExUnitRelease(vm, source);
-
-    if (status != AGATE_STATUS_OK) {
-      fprintf(stderr, "Error in the agraphics unit '%s'.\n", argv[1]);
-    }
-  } else {
-    fprintf(stderr, "Could not find agraphics unit '%s'.\n", argv[1]);
+  if (watch) {
+#ifdef AGRAPHICS_HAS_INOTIFY
+    return agWatch(&config, unit_name);
+#else
+    fprintf(stderr, "Watch mode is not supported on this platform.\n");
+#endif
   }
 
+  AgateVM *vm = agCreateVM(&config);
+  bool ok = agRunUnit(vm, unit_name);
   agateExDeleteVM(vm);
 
-  return EXIT_SUCCESS;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,47 @@
+# usage: cmake -DAGRAPHICS=<executable> -DSOURCE_DIR=<dir> -DOUTPUT=<file> -P banded_wide.cmake
+
+execute_process(
+  COMMAND "${AGRAPHICS}" tests/banded_wide
+  WORKING_DIRECTORY "${SOURCE_DIR}"
+  OUTPUT_FILE "${OUTPUT}"
+  ERROR_VARIABLE errors
+  RESULT_VARIABLE result
+)
+
+if(NOT result EQUAL 0 OR NOT errors STREQUAL "")
+  message(FATAL_ERROR "agraphics failed: ${errors}")
+endif()
+
+set(header "P7\nWIDTH 40000\nHEIGHT 4\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n")
+string(LENGTH "${header}" header_size)
+file(READ "${OUTPUT}" actual_header LIMIT ${header_size})
+
+if(NOT actual_header STREQUAL header)
+  message(FATAL_ERROR "Unexpected header: ${actual_header}")
+endif()
+
+# x, y, expected RGBA, on both sides of the seam and of the rectangle
+set(pixels
+  "0,0,00000000"
+  "31999,0,00000000"
+  "32000,0,ff00ffff"
+  "32766,1,ff00ffff"
+  "32767,1,ff00ffff"
+  "32768,2,ff00ffff"
+  "33999,3,ff00ffff"
+  "34000,3,00000000"
+  "39999,3,00000000"
+)
+
+foreach(entry IN LISTS pixels)
+  string(REPLACE "," ";" pixel "${entry}")
+  list(GET pixel 0 x)
+  list(GET pixel 1 y)
+  list(GET pixel 2 expected)
+  math(EXPR offset "${header_size} + (${y} * 40000 + ${x}) * 4")
+  file(READ "${OUTPUT}" actual OFFSET ${offset} LIMIT 4 HEX)
+
+  if(NOT actual STREQUAL expected)
+    message(FATAL_ERROR "Pixel (${x}, ${y}) is ${actual}, expected ${expected}")
+  endif()
+endforeach()